@@ -5,4 +5,9 @@
 
 CFLAGS=-g -O3 -fleading-underscore -mcmodel=large -nostdlib -nodefaultlibs -fno-builtin -fno-stack-protector -fno-pie -mno-sse -mno-sse2 -mno-avx -I../../include
 
+# Build the microbenchmarks (make BENCH=1)
+ifeq ($(BENCH),1)
+CFLAGS+=-DBENCH=1
+endif
+
 
@@ -50,6 +50,7 @@ typedef uint64_t uintptr_t;
 typedef signed int pid_t;
 typedef signed int uid_t;
 typedef signed int gid_t;
+typedef signed int id_t;
 
 /* Filesystem */
 typedef int32_t dev_t;
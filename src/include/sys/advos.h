@@ -26,7 +26,13 @@
 
 #include <advos/types.h>
 
+/* Memory policies for set_mempolicy() */
+#define MPOL_LOCAL      0       /* Local NUMA domain first */
+#define MPOL_BIND       1       /* Only the specified domain */
+#define MPOL_INTERLEAVE 2       /* Round-robin over all domains */
+
 int initexec(const char *, char *const [], char *const []);
+int set_mempolicy(int, int);
 
 #endif
 
@@ -29,10 +29,13 @@
 #define SYS_read        3
 #define SYS_write       4
 #define SYS_execve      59
+#define SYS_setpriority 96
+#define SYS_getpriority 100
 #define SYS_nanosleep   240
 #define SYS_fstat       551
 #define SYS_initexec    701
 #define SYS_driver      702
+#define SYS_set_mempolicy 703
 #define SYS_MAXSYSCALL  768
 
 #endif /* _SYS_SYSCALL_H */
@@ -26,6 +26,7 @@
 
 typedef long long time_t;
 typedef long suseconds_t;
+typedef int clockid_t;
 
 #endif /* _SYS_TYPES_H */
 
@@ -26,6 +26,9 @@
 
 #include <sys/types.h>
 
+/* Clocks */
+#define CLOCK_MONOTONIC 4
+
 struct timespec {
     time_t tv_sec;
     long tv_nsec;
@@ -46,6 +49,7 @@ struct tm {
 };
 
 int nanosleep(const struct timespec *, struct timespec *);
+int clock_gettime(clockid_t, struct timespec *);
 
 #endif /* _TIME_H */
 
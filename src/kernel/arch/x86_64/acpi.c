@@ -30,7 +30,6 @@
    address >> 4 (16 bit) is stored in 0x040e. */
 #define BDA_EDBA        0x040e
 
-#define ACPI_TMR_HZ 3579545
 #define ACPI_SCI_EN 0x1
 #define ACPI_SLP_EN (1<<13)
 
@@ -241,6 +240,18 @@ struct acpi_sdt_srat_hdr {
     /* acpi_sdt_srat_*[n] */
 } __attribute__ ((packed));
 
+/*
+ * SLIT
+ * - acpi_sdt_hdr
+ * - number of system localities
+ * - entry[n][n]
+ */
+struct acpi_sdt_slit_hdr {
+    /* acpi_sdt_hdr */
+    uint64_t nr;
+    /* entry[nr * nr] */
+} __attribute__ ((packed));
+
 
 /* Prototype declarations */
 static int _validate_checksum(const uint8_t *, int);
@@ -407,6 +418,41 @@ _parse_fadt(acpi_t *acpi, struct acpi_sdt_hdr *sdt)
     return 0;
 }
 
+/*
+ * Parse ACPI System Locality Information Table (SLIT)
+ */
+static int
+_parse_slit(acpi_t *acpi, struct acpi_sdt_hdr *sdt)
+{
+    struct acpi_sdt_slit_hdr *slit;
+    uint8_t *entry;
+    uint64_t nr;
+    uint64_t n;
+    uint64_t i;
+    uint64_t j;
+
+    slit = (struct acpi_sdt_slit_hdr *)((uint64_t)sdt
+                                        + sizeof(struct acpi_sdt_hdr));
+    entry = (uint8_t *)slit + sizeof(struct acpi_sdt_slit_hdr);
+    nr = slit->nr;
+    if ( sizeof(struct acpi_sdt_hdr) + sizeof(struct acpi_sdt_slit_hdr)
+         + nr * nr > sdt->length ) {
+        /* Oversized */
+        return 0;
+    }
+
+    /* Domains beyond MAX_NUMA_DOMAINS take the default distances */
+    n = nr < MAX_NUMA_DOMAINS ? nr : MAX_NUMA_DOMAINS;
+    for ( i = 0; i < n; i++ ) {
+        for ( j = 0; j < n; j++ ) {
+            acpi->slit[i * n + j] = entry[i * nr + j];
+        }
+    }
+    acpi->num_slit_domains = n;
+
+    return 0;
+}
+
 /*
  * Parse ACPI Static Resource Affinity Table (SRAT)
  */
@@ -528,6 +574,11 @@ _parse_rsdt(acpi_t *acpi, struct acpi_rsdp *rsdp)
             if ( _parse_srat(acpi, tmp) < 0 ) {
                 return -1;
             }
+        } else if ( 0 == kmemcmp((uint8_t *)tmp->signature, "SLIT", 4) ) {
+            /* SLIT */
+            if ( _parse_slit(acpi, tmp) < 0 ) {
+                return -1;
+            }
         }
     }
 
@@ -27,6 +27,9 @@
 #include <stdint.h>
 #include "const.h"
 
+/* Frequency of the ACPI PM timer */
+#define ACPI_TMR_HZ     3579545
+
 /*
  * ACPI configuration
  */
@@ -61,6 +64,10 @@ typedef struct {
         uint64_t length;
         uint32_t domain;
     } memory_domain[MAX_MEMORY_REGIONS];
+
+    /* Distances between domains (SLIT) */
+    int num_slit_domains;
+    uint8_t slit[MAX_NUMA_DOMAINS * MAX_NUMA_DOMAINS];
 } acpi_t;
 
 int acpi_load(acpi_t *, uintptr_t p2v);
@@ -259,6 +259,65 @@ lapic_start_timer(uint64_t busfreq, uint64_t freq, uint8_t vec)
     mfwr32(apic_base + APIC_INITTMR, (busfreq >> 4) / freq);
 }
 
+/*
+ * Set up local APIC timer in one-shot mode (the timer is armed by
+ * lapic_arm_timer())
+ */
+void
+lapic_start_oneshot_timer(uint8_t vec)
+{
+    uint64_t apic_base;
+
+    apic_base = lapic_base_addr();
+
+    mfwr32(apic_base + APIC_INITTMR, 0);
+    mfwr32(apic_base + APIC_LVT_TMR, APIC_LVT_ONESHOT | (uint32_t)vec);
+    mfwr32(apic_base + APIC_TMRDIV, APIC_TMRDIV_X16);
+}
+
+/*
+ * Set up local APIC timer in TSC-deadline mode (the timer is armed by writing
+ * the deadline to the IA32_TSC_DEADLINE MSR)
+ */
+void
+lapic_start_tsc_deadline_timer(uint8_t vec)
+{
+    uint64_t apic_base;
+
+    apic_base = lapic_base_addr();
+
+    mfwr32(apic_base + APIC_LVT_TMR, APIC_LVT_TSC_DEADLINE | (uint32_t)vec);
+    /* Serialize the LVT write and the following MSR write */
+    mfence();
+    wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+}
+
+/*
+ * Arm the one-shot timer with the initial count; 0 stops the timer
+ */
+void
+lapic_arm_timer(uint32_t count)
+{
+    uint64_t apic_base;
+
+    apic_base = lapic_base_addr();
+
+    mfwr32(apic_base + APIC_INITTMR, count);
+}
+
+/*
+ * Read the current count of the timer
+ */
+uint32_t
+lapic_read_timer(void)
+{
+    uint64_t apic_base;
+
+    apic_base = lapic_base_addr();
+
+    return mfrd32(apic_base + APIC_CURTMR);
+}
+
 /*
  * Stop APIC timer
  */
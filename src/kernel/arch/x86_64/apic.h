@@ -65,6 +65,7 @@
 #define APIC_TMRDIV_X64                 0x9
 #define APIC_TMRDIV_X128                0xa
 
+uint64_t lapic_base_addr(void);
 int lapic_id(void);
 void lapic_send_init_ipi(void);
 void lapic_send_startup_ipi(uint8_t);
@@ -73,6 +74,10 @@ void lapic_send_fixed_ipi(int, uint8_t);
 void lapic_set_timer(uint32_t, int);
 uint64_t lapic_stop_and_read_timer(void);
 void lapic_start_timer(uint64_t, uint64_t, uint8_t);
+void lapic_start_oneshot_timer(uint8_t);
+void lapic_start_tsc_deadline_timer(uint8_t);
+void lapic_arm_timer(uint32_t);
+uint32_t lapic_read_timer(void);
 void lapic_stop_timer(void);
 void ioapic_init(void);
 void ioapic_map_intr(uint64_t, uint64_t, uint64_t);
@@ -29,11 +29,14 @@
 #include "desc.h"
 #include "i8254.h"
 #include "pgt.h"
+#include "tsc.h"
+#include "fpu.h"
 #include "const.h"
 #include "../../kernel.h"
 #include "../../memory.h"
 #include "../../kvar.h"
 #include "../../sched.h"
+#include "../../timer.h"
 #include <stdint.h>
 #include <sys/syscall.h>
 
@@ -42,6 +45,16 @@
 #define PGT_SLAB_NAME               "pgt"
 #define ARCH_TASK_NAME              "arch_task"
 
+/* Page fault error code */
+#define PF_ERROR_PRESENT            (1 << 0)
+#define PF_ERROR_WRITE              (1 << 1)
+#define PF_ERROR_USER               (1 << 2)
+
+/* Slab caches */
+static memory_slab_cache_t *_vmem_cache;
+static memory_slab_cache_t *_vmem_data_cache;
+static memory_slab_cache_t *_pgt_cache;
+
 /* For trampoline code */
 void trampoline(void);
 void trampoline_end(void);
@@ -172,61 +185,69 @@ isr_exception_werror(uint32_t vec, uint64_t error, uint64_t rip, uint64_t cs,
 }
 
 /*
- * Error handler for device not available (#NM)
+ * Error handler for device not available (#NM); restore the FPU/SSE context of
+ * the current task on its first use in the time slice
  */
 void
 isr_device_not_available(uint64_t rip, uint64_t cs, uint64_t rflags,
                          uint64_t rsp)
 {
-    task_t *t;
     struct arch_task *at;
     struct arch_cpu_data *cpu;
-
-    uint64_t rax;
-    uint64_t rbx;
-    uint64_t rcx;
-    uint64_t rdx;
+    fpu_t *fpu;
 
     (void)rip;
     (void)cs;
     (void)rflags;
     (void)rsp;
 
-    cpu = (struct arch_cpu_data *)(uintptr_t)CPU_TASK(lapic_id());
-
-    /* CPU */
-    rax = cpuid(1, &rbx, &rcx, &rdx);
-    if ( (rcx >> 26) & 1 ) {
-        /* XSAVE: To implement */
-    } else if ( (rdx >> 24) & 1 ) {
-        /* FXSR */
-        t = this_task();
-        at = t->arch;
-        /* Clear TS */
-        clts();
-        if ( cpu->fpu_task != at ) {
-            if ( NULL != cpu->fpu_task ) {
-                fxsave64(cpu->fpu_task->xregs);
-            }
-            fxrstor64(at->xregs);
-            cpu->fpu_task = at;
+    cpu = this_cpu();
+    fpu = &((arch_var_t *)g_kvar->arch)->fpu;
+    at = this_task()->arch;
+
+    /* Clear TS */
+    clts();
+    if ( cpu->fpu_task != at ) {
+        if ( NULL != cpu->fpu_task ) {
+            fpu_save(fpu, cpu->fpu_task->xregs);
         }
+        fpu_restore(fpu, at->xregs);
+        cpu->fpu_task = at;
     }
+
+    /* Count the consecutive time slices using the FPU */
+    at->fpu_counter++;
 }
 
 /*
- * Error handler for page fault (#PF)
+ * Error handler for page fault (#PF); allocate the page on the first touch or
+ * copy the page shared copy-on-write, otherwise terminate the process on the
+ * invalid access from the user mode.  #PF is an interrupt gate so that the
+ * task is neither preempted nor migrated while the memory manager holds its
+ * locks or per-CPU caches.
  */
 void
 isr_page_fault(uint64_t virtual, uint64_t error, uint64_t rip, uint64_t cs,
                uint64_t rflags, uint64_t rsp)
 {
-    char buf[4096];
+    /* Keep the stack usage small; this may be nested in a system call */
+    char buf[256];
     task_t *t;
     char *pname;
+    int flags;
+    int ret;
 
     t = this_task();
+
     if ( NULL != t->proc ) {
+        flags = 0;
+        if ( error & PF_ERROR_WRITE ) {
+            flags |= MEMORY_FAULT_WRITE;
+        }
+        ret = virt_memory_fault(t->proc->vmem, virtual, flags);
+        if ( 0 == ret ) {
+            return;
+        }
         pname = t->proc->name;
     } else {
         pname = NULL;
@@ -234,6 +255,13 @@ isr_page_fault(uint64_t virtual, uint64_t error, uint64_t rip, uint64_t cs,
     ksnprintf(buf, sizeof(buf), "#PF: task=%llx (%s), virtual=%llx, "
               "error=%llx, rip=%llx, cs=%llx, rflags=%llx, rsp=%llx", t,
               pname, virtual, error, rip, cs, rflags, rsp);
+    if ( (error & PF_ERROR_USER) && NULL != t->proc ) {
+        /* Invalid access from the process; terminate it */
+        kprintf("%s\r\n", buf);
+        t->state = TASK_TERMINATED;
+        t->proc->exit_status = -1;
+        task_exit();
+    }
     panic(buf);
 }
 
@@ -257,21 +285,21 @@ _add_region_to_numa_zones(phys_memory_t *mem, acpi_t *acpi, uintptr_t base,
             if ( base >= s && next <= t ) {
                 /* Within the domain, then add this region to the buddy
                    system */
-                phys_mem_buddy_add_region(mem->numazones[dom].heads,
+                phys_mem_buddy_add_region(&mem->numazones[dom],
                                           base + mem->p2v, next + mem->p2v);
             } else if ( base >= s ) {
                 /* s <= base <= t < next */
-                phys_mem_buddy_add_region(mem->numazones[dom].heads,
+                phys_mem_buddy_add_region(&mem->numazones[dom],
                                           base + mem->p2v, t + mem->p2v);
             } else if ( next <= t ) {
                 /* base < s < next <= t */
-                phys_mem_buddy_add_region(mem->numazones[dom].heads,
+                phys_mem_buddy_add_region(&mem->numazones[dom],
                                           s + mem->p2v, next + mem->p2v);
             }
         }
     } else {
         /* Non-NUMA (UMA) */
-        phys_mem_buddy_add_region(mem->numazones[0].heads,
+        phys_mem_buddy_add_region(&mem->numazones[0],
                                   base + mem->p2v, next + mem->p2v);
     }
 }
@@ -367,7 +395,7 @@ _init_kernel_pgt(kvar_t *kvar, size_t nr, memory_sysmap_entry_t *map)
     npg = ((maxaddr + 0x3fffffff) >> 30);
 
     /* Allocate 512 pages for page tables */
-    pages = phys_mem_buddy_alloc(kvar->phys.czones[MEMORY_ZONE_KERNEL].heads,
+    pages = phys_mem_buddy_alloc(&kvar->phys.czones[MEMORY_ZONE_KERNEL],
                                  9);
     if ( NULL == pages ) {
         return -1;
@@ -455,11 +483,11 @@ _init_numa_zones(phys_memory_t *mem, acpi_t *acpi, int nr,
         sz >>= 1;
         order++;
     }
-    zones = phys_mem_buddy_alloc(mem->czones[MEMORY_ZONE_KERNEL].heads, order);
+    zones = phys_mem_buddy_alloc(&mem->czones[MEMORY_ZONE_KERNEL], order);
     if ( NULL == zones ) {
         return -1;
     }
-    kmemset(zones, 0, sizeof(1 << (order + MEMORY_PAGESIZE_SHIFT)));
+    kmemset(zones, 0, 1ULL << (order + MEMORY_PAGESIZE_SHIFT));
     mem->numazones = zones;
     mem->max_domain = max_domain;
 
@@ -486,9 +514,38 @@ _init_numa_zones(phys_memory_t *mem, acpi_t *acpi, int nr,
         }
     }
 
+    /* Track the buddies */
+    for ( i = 0; i <= (int)max_domain; i++ ) {
+        if ( phys_mem_buddy_track(mem, &mem->numazones[i]) < 0 ) {
+            return -1;
+        }
+    }
+
     return 0;
 }
 
+/*
+ * Set up the NUMA topology for the memory policies from SRAT and SLIT
+ */
+static int
+_init_numa_policy(phys_memory_t *mem, acpi_t *acpi)
+{
+    int domains[MAX_PROCESSORS];
+    int i;
+
+    for ( i = 0; i < MAX_PROCESSORS; i++ ) {
+        if ( acpi->lapic_domain[i].valid ) {
+            domains[i] = acpi->lapic_domain[i].domain;
+        } else {
+            domains[i] = 0;
+        }
+    }
+
+    return phys_mem_numa_init(mem, domains, MAX_PROCESSORS,
+                              acpi->num_slit_domains > 0 ? acpi->slit : NULL,
+                              acpi->num_slit_domains);
+}
+
 /*
  * Estimate bus frequency
  */
@@ -708,60 +765,265 @@ arch_memory_v2p(void *arch, void *addr)
 }
 
 /*
- * Local APIC timer handler
+ * Set up the per-core data of this processor and point the GS base to it
  */
-void
-ksignal_clock(void)
+static void
+_percpu_init(int id)
+{
+    struct arch_cpu_data *cpu;
+
+    cpu = (struct arch_cpu_data *)CPU_TASK(id);
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu->lapic_base = lapic_base_addr();
+
+    /* The kernel GS base is active in the kernel; the user one (zero) is
+       swapped in by swapgs on the return to the user mode */
+    wrmsr(MSR_IA32_GS_BASE, CPU_DATA(id));
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
+}
+
+/*
+ * Get the ID of this processor
+ */
+int
+this_cpu_id(void)
+{
+    return percpu_read(id);
+}
+
+/*
+ * Clock source
+ */
+static __inline__ tsc_clock_t *
+_clock(void)
+{
+    return &((arch_var_t *)g_kvar->arch)->clock;
+}
+
+/*
+ * Get the monotonic clock in nanoseconds
+ */
+uint64_t
+clock_monotonic(void)
+{
+    return tsc_to_ns(_clock(), rdtsc());
+}
+
+/*
+ * Publish the clock source to the time page
+ */
+static void
+_timepage_update(tsc_clock_t *clk)
+{
+    struct timepage *tp;
+
+    tp = g_kvar->timepage;
+    tp->seq++;
+    barrier();
+    tp->shift = TSC_NS_SHIFT;
+    tp->base = clk->base;
+    tp->mult = clk->mult;
+    barrier();
+    tp->seq++;
+}
+
+/*
+ * Get the number of tick boundaries passed since the last call
+ */
+static uint64_t
+_tick_elapsed(struct arch_cpu_data *cpu)
+{
+    tsc_clock_t *clk;
+    uint64_t now;
+    uint64_t ticks;
+
+    clk = _clock();
+    now = rdtsc();
+    if ( now < cpu->tmr_next ) {
+        return 0;
+    }
+    ticks = (now - cpu->tmr_next) / clk->tick + 1;
+    cpu->tmr_next += ticks * clk->tick;
+
+    return ticks;
+}
+
+/*
+ * Arm the timer at the tick boundary when the slice of the next task ends, or
+ * at the expiry of the earliest high-resolution timer.  The timer is stopped if
+ * there is nothing to do on this processor.
+ */
+static void
+_tick_arm(int id, struct arch_cpu_data *cpu)
+{
+    tsc_clock_t *clk;
+    struct arch_task *at;
+    uint64_t ticks;
+    uint64_t d;
+    uint64_t deadline;
+    uint64_t now;
+    uint64_t count;
+
+    clk = _clock();
+
+    at = NULL != cpu->next_task ? cpu->next_task : cpu->cur_task;
+    if ( NULL != at && at != cpu->idle_task ) {
+        /* Slice end */
+        ticks = at->task->credit > 0 ? at->task->credit : 1;
+    } else {
+        ticks = 0;
+    }
+    if ( ticks > 0 ) {
+        deadline = cpu->tmr_next + (ticks - 1) * clk->tick;
+    } else {
+        deadline = 0;
+    }
+    /* Earliest high-resolution timer on this processor if it is earlier */
+    d = hrtimer_arm(id, deadline > 0 ? tsc_to_ns(clk, deadline) : 0);
+    if ( d > 0 ) {
+        deadline = tsc_from_ns(clk, d);
+    }
+
+    if ( clk->deadline ) {
+        /* TSC-deadline mode (0 stops the timer, and a deadline in the past
+           fires immediately) */
+        wrmsr(MSR_IA32_TSC_DEADLINE, deadline);
+        return;
+    }
+
+    /* One-shot mode */
+    if ( 0 == deadline ) {
+        /* Stop the timer until another processor kicks this processor */
+        lapic_arm_timer(0);
+        return;
+    }
+    now = rdtsc();
+    if ( deadline > now ) {
+        count = ((__uint128_t)(deadline - now) * cpu->tmr_mult) >> 32;
+    } else {
+        count = 0;
+    }
+    if ( count < 1 ) {
+        count = 1;
+    } else if ( count > 0xffffffffULL ) {
+        /* Fires early, then re-armed */
+        count = 0xffffffffULL;
+    }
+    lapic_arm_timer(count);
+}
+
+/*
+ * Start the tick of this processor in TSC-deadline mode if available, or in
+ * one-shot mode otherwise
+ */
+static void
+_tick_start(struct arch_cpu_data *cpu)
+{
+    tsc_clock_t *clk;
+
+    clk = _clock();
+    if ( clk->deadline ) {
+        lapic_start_tsc_deadline_timer(IV_LOC_TMR);
+    } else {
+        cpu->tmr_mult = ((cpu->busfreq >> 4) << 32) / clk->freq;
+        lapic_start_oneshot_timer(IV_LOC_TMR);
+    }
+    cpu->tmr_next = rdtsc() + clk->tick;
+
+    /* Arm the first tick */
+    _tick_arm(cpu->id, cpu);
+}
+
+/*
+ * Low level scheduler; select the next task to run on this processor
+ */
+static void
+_schedule(int id, struct arch_cpu_data *cpu)
 {
     task_t *t;
 
-    if ( lapic_id() == 0 ) {
-        /* Increment jiffies */
-        g_kvar->jiffies++;
-
-        /* Execute timer */
-        timer_event_t *e;
-        timer_event_t *tmp;
-        e = g_kvar->timer;
-        while ( NULL != e && e->jiffies < g_kvar->jiffies ) {
-            /* Fire the event */
-            e->proc->task->state = TASK_READY;
-            tmp = e;
-            e = e->next;
-            kmem_slab_free("timer_event", tmp);
-        }
-        g_kvar->timer = e;
-
-        /* Schedule next task (and context switch) */
-        struct arch_cpu_data *cpu;
-        cpu = (struct arch_cpu_data *)CPU_TASK(0);
-
-        if ( NULL != cpu->cur_task ) {
-            t = this_task();
-            t->credit--;
-            if ( t->credit > 0 ) {
-                /* Keep this task */
-                return;
-            }
+    t = sched_pick_next(id);
+    if ( NULL != t ) {
+        cpu->next_task = t->arch;
+    } else if ( NULL != cpu->cur_task && cpu->cur_task != cpu->idle_task ) {
+        t = cpu->cur_task->task;
+        if ( TASK_RUNNING == t->state || TASK_READY == t->state ) {
+            /* No other task to run; keep this task */
+            t->state = TASK_RUNNING;
+        } else {
+            cpu->next_task = cpu->idle_task;
         }
+    }
+}
 
-        /* Execute high-level scheduler */
-        if ( NULL == g_kvar->runqueue ) {
-            sched_schedule();
-        }
-        if ( NULL != cpu->cur_task ) {
-            cpu->cur_task->task->state = TASK_READY;
-        }
-        if ( NULL == g_kvar->runqueue ) {
-            cpu->next_task = cpu->idle_task;
-        } else {
-            /* Low level scheduler */
-            t = g_kvar->runqueue;
-            g_kvar->runqueue = t->next;
-            cpu->next_task = t->arch;
-            t->state = TASK_RUNNING;
+/*
+ * Process the ticks elapsed and the scheduling on this processor
+ */
+static void
+_tick(int resched)
+{
+    int id;
+    struct arch_cpu_data *cpu;
+    uint64_t ticks;
+    task_t *t;
+
+    cpu = this_cpu();
+    id = cpu->id;
+
+    ticks = _tick_elapsed(cpu);
+
+    /* Execute the timers expired on this processor */
+    hrtimer_run(id, clock_monotonic());
+
+    /* Schedule next task (and context switch).  N.B., the current task is put
+       back to the run queue by task_switched() once its context is saved. */
+    if ( NULL != cpu->cur_task && cpu->cur_task != cpu->idle_task ) {
+        t = cpu->cur_task->task;
+        if ( (ticks > 0 && sched_tick(id, t, ticks))
+             || (resched && sched_preempt(id, t)) ) {
+            _schedule(id, cpu);
         }
+    } else {
+        _schedule(id, cpu);
     }
+
+    /* Arm the timer for the next event */
+    _tick_arm(id, cpu);
+}
+
+/*
+ * Local APIC timer handler
+ */
+void
+ksignal_clock(void)
+{
+    _tick(0);
+}
+
+/*
+ * Reschedule request handler
+ */
+void
+ksignal_resched(void)
+{
+    _tick(1);
+}
+
+/*
+ * Switch from the current task that has been terminated to the next task (or
+ * the idle task); called with interrupts disabled and never returns
+ */
+void
+task_exit(void)
+{
+    struct arch_cpu_data *cpu;
+
+    cpu = this_cpu();
+    _schedule(cpu->id, cpu);
+    task_switch();
+
+    panic("A terminated task has been resumed.");
 }
 
 /*
@@ -772,14 +1034,24 @@ task_idle(void)
 {
     uint16_t *base;
     uint64_t cnt;
+    int ret;
 
     base = (uint16_t *)VIDEO_RAM_80X25;
     cnt = 0;
     while ( 1 ) {
+        /* Refill the pre-zeroed page pools one page at a time with interrupts
+           disabled so that the locks are never held across preemption */
+        cli();
+        ret = phys_mem_zeroed_fill(&g_kvar->phys);
+        sti();
+        if ( ret ) {
+            continue;
+        }
+
         if ( (cnt / 10) & 1 )  {
-            *(base + 80 * lapic_id() + 79) = 0x0700 | '!';
+            *(base + 80 * percpu_read(id) + 79) = 0x0700 | '!';
         } else {
-            *(base + 80 * lapic_id() + 79) = 0x0700 | ' ';
+            *(base + 80 * percpu_read(id) + 79) = 0x0700 | ' ';
         }
         cnt++;
         hlt();
@@ -795,7 +1067,7 @@ vmem_data_alloc(virt_memory_t *vmem)
     void *data;
 
     (void)vmem;
-    data = kmem_slab_alloc(VIRT_MEMORY_SLAB_DATA_NAME);
+    data = kmem_slab_cache_alloc(_vmem_data_cache);
     if ( NULL == data ) {
         return NULL;
     }
@@ -815,7 +1087,7 @@ vmem_data_free(virt_memory_t *vmem, void *data)
     int ret;
 
     (void)vmem;
-    ret = kmem_slab_free(VIRT_MEMORY_SLAB_DATA_NAME, data);
+    ret = kmem_slab_cache_free(_vmem_data_cache, data);
     kassert( ret == 0 );
 }
 
@@ -827,17 +1099,18 @@ vmem_callback_init(void)
 {
     int ret;
 
-    ret = kmem_slab_create_cache(VIRT_MEMORY_SLAB_NAME, sizeof(virt_memory_t));
-    if ( ret < 0 ) {
+    _vmem_cache = kmem_slab_create_cache(VIRT_MEMORY_SLAB_NAME,
+                                         sizeof(virt_memory_t), 0);
+    if ( NULL == _vmem_cache ) {
         return -1;
     }
-    ret = kmem_slab_create_cache(VIRT_MEMORY_SLAB_DATA_NAME,
-                                 sizeof(virt_memory_data_t));
-    if ( ret < 0 ) {
+    _vmem_data_cache = kmem_slab_create_cache(VIRT_MEMORY_SLAB_DATA_NAME,
+                                              sizeof(virt_memory_data_t), 0);
+    if ( NULL == _vmem_data_cache ) {
         return -1;
     }
-    ret = kmem_slab_create_cache(PGT_SLAB_NAME, sizeof(pgt_t));
-    if ( ret < 0 ) {
+    _pgt_cache = kmem_slab_create_cache(PGT_SLAB_NAME, sizeof(pgt_t), 0);
+    if ( NULL == _pgt_cache ) {
         return -1;
     }
 
@@ -861,20 +1134,20 @@ arch_memory_new(void)
     void *pages;
     pgt_t *pgt;
 
-    vmem = kmem_slab_alloc(VIRT_MEMORY_SLAB_NAME);
+    vmem = kmem_slab_cache_alloc(_vmem_cache);
     if ( NULL == vmem ) {
         return NULL;
     }
 
     /* Prepare pgt_t */
-    pages = phys_mem_buddy_alloc(g_kvar->phys.czones[MEMORY_ZONE_KERNEL].heads,
-                                 9);
+    pages = phys_mem_alloc(&g_kvar->phys, 9, MEMORY_ZONE_KERNEL, 0);
     if ( NULL == pages ) {
         return NULL;
     }
-    pgt = kmem_slab_alloc(PGT_SLAB_NAME);
+    pages += g_kvar->phys.p2v;
+    pgt = kmem_slab_cache_alloc(_pgt_cache);
     if ( NULL == pgt ) {
-        kmem_slab_free(VIRT_MEMORY_SLAB_NAME, vmem);
+        kmem_slab_cache_free(_vmem_cache, vmem);
         return NULL;
     }
     pgt_init(pgt, pages, 1 << 9, KERNEL_LMAP);
@@ -885,10 +1158,10 @@ arch_memory_new(void)
     a.free = vmem_data_free;
     ret = virt_memory_new(vmem, &g_kvar->mm, &a);
     if ( ret < 0 ) {
-        phys_mem_buddy_free(g_kvar->phys.czones[MEMORY_ZONE_KERNEL].heads,
-                            pages, 9);
-        kmem_slab_free(PGT_SLAB_NAME, pgt);
-        kmem_slab_free(VIRT_MEMORY_SLAB_NAME, vmem);
+        phys_mem_free(&g_kvar->phys, pages - g_kvar->phys.p2v, 9,
+                      MEMORY_ZONE_KERNEL, 0);
+        kmem_slab_cache_free(_pgt_cache, pgt);
+        kmem_slab_cache_free(_vmem_cache, vmem);
         return NULL;
     }
     vmem->flags = MEMORY_MAP_USER;
@@ -963,7 +1236,10 @@ _init_new(void)
 
     /* Program */
     prog = (void *)PROC_PROG_ADDR;
-    kmemcpy(prog, start, size);
+    ret = virt_memory_write(proc->vmem, PROC_PROG_ADDR, start, size);
+    if ( ret < 0 ) {
+        return NULL;
+    }
 
     ret = task_init(proc->task, prog);
     if ( ret < 0 ) {
@@ -997,14 +1273,17 @@ _prepare_multitasking(void)
         panic("Could not find init.");
     }
 
-    ret = kmem_slab_create_cache(ARCH_TASK_NAME, sizeof(struct arch_task));
-    if ( ret < 0 ) {
+    if ( NULL == kmem_slab_create_cache(ARCH_TASK_NAME,
+                                        sizeof(struct arch_task), 0) ) {
         panic("Cannot create a slab for arch_task.");
     }
 
     /* Set the task A as the initial task */
     cpu = (struct arch_cpu_data *)CPU_TASK(0);
     cpu->next_task = proc->task->arch;
+    proc->task->state = TASK_RUNNING;
+    proc->task->oncpu = 1;
+    proc->task->credit = SCHED_QUANTUM;
 
     return 0;
 }
@@ -1062,6 +1341,7 @@ bsp_start(void)
     sysaddrmap_entry_t *ent;
     int i;
     uint64_t busfreq;
+    uint64_t freq;
     console_dev_t *dev;
     void *bstack;
     struct arch_cpu_data *cpu;
@@ -1091,6 +1371,19 @@ bsp_start(void)
     tss_init();
     tr_load(lapic_id());
 
+    /* Per-core data */
+    _percpu_init(lapic_id());
+
+    /* Write-protect the read-only pages from the kernel as well to break the
+       copy-on-write sharing on its writes */
+    wp_enable();
+
+    /* FPU/SSE context */
+    ret = fpu_init(&((arch_var_t *)kvar->arch)->fpu);
+    if ( ret < 0 ) {
+        panic("FPU context save is not supported.");
+    }
+
     /* Ensure the i8254 timer is stopped */
     i8254_stop_timer();
 
@@ -1115,7 +1408,7 @@ bsp_start(void)
     if ( sizeof(acpi_t) > MEMORY_PAGESIZE * 4 ) {
         panic("The size of acpi_t exceeds the expected size.");
     }
-    acpi = memory_alloc_pages(&kvar->mm, 4, MEMORY_ZONE_KERNEL, 0);
+    acpi = memory_alloc_pages(&kvar->mm, 4, MEMORY_ZONE_KERNEL, 0, 0);
     if ( NULL == acpi ) {
         panic("Memory allocation failed for acpi_t.");
     }
@@ -1134,6 +1427,18 @@ bsp_start(void)
         panic("Failed to initialize the NUMA-aware zones.");
     }
 
+    /* Initialize the per-CPU page caches */
+    ret = phys_mem_pcp_init(&kvar->phys, MAX_PROCESSORS);
+    if ( ret < 0 ) {
+        panic("Failed to initialize the per-CPU page caches.");
+    }
+
+    /* Initialize the NUMA allocation policy */
+    ret = _init_numa_policy(&kvar->phys, acpi);
+    if ( ret < 0 ) {
+        panic("Failed to initialize the NUMA allocation policy.");
+    }
+
     /* Initialize the slab allocator */
     ret = kmem_slab_init();
     if ( ret < 0 ) {
@@ -1183,13 +1488,39 @@ bsp_start(void)
     }
 
     /* Initialize the scheduler */
-    g_kvar->runqueue = NULL;
+    ret = sched_init(MAX_PROCESSORS);
+    if ( ret < 0 ) {
+        panic("Failed to initialize the scheduler.");
+    }
+
+    /* Initialize the timers */
+    ret = timer_init(MAX_PROCESSORS);
+    if ( ret < 0 ) {
+        panic("Failed to initialize the timer.");
+    }
+    ret = timer_cpu_init(lapic_id());
+    if ( ret < 0 ) {
+        panic("Failed to initialize the timer.");
+    }
+
+    /* Use the base frequency of the invariant TSC for the clock source, or
+       calibrate the TSC against the ACPI PM timer if not resolved */
+    freq = tsc_invariant_freq();
+    if ( 0 == freq ) {
+        if ( acpi_timer_available(acpi) < 0 ) {
+            panic("ACPI PM timer is not available.");
+        }
+        freq = tsc_calibrate(acpi);
+    }
+    tsc_clock_init(&((arch_var_t *)kvar->arch)->clock, freq);
+    _timepage_update(&((arch_var_t *)kvar->arch)->clock);
 
     /* Setup system call */
     syscall_init(g_kvar->syscalls, SYS_MAXSYSCALL);
 
     /* Setup trap gates */
     idt_setup_intr_gate(IV_LOC_TMR, intr_apic_loc_tmr);
+    idt_setup_intr_gate(IV_RESCHED, intr_resched);
     idt_setup_intr_gate(IV_CRASH, intr_apic_loc_tmr);
     idt_setup_trap_gate(0, intr_de);
     idt_setup_trap_gate(1, intr_db);
@@ -1205,7 +1536,7 @@ bsp_start(void)
     idt_setup_trap_gate(11, intr_np);
     idt_setup_trap_gate(12, intr_ss);
     idt_setup_trap_gate(13, intr_gp);
-    idt_setup_trap_gate(14, intr_pf);
+    idt_setup_intr_gate(14, intr_pf);
     idt_setup_trap_gate(16, intr_mf);
     idt_setup_trap_gate(17, intr_ac);
     idt_setup_trap_gate(18, intr_mc);
@@ -1217,11 +1548,10 @@ bsp_start(void)
     /* Prepare stack for appliation processors.  N.B., the stack must be in the
        kernel zone so that 32-bit code can refer to it. */
     bstack = memory_alloc_pages(&kvar->mm, MAX_PROCESSORS,
-                                MEMORY_ZONE_KERNEL, 0);
+                                MEMORY_ZONE_KERNEL, 0, MEMORY_ALLOC_ZEROED);
     if ( NULL == bstack ) {
         panic("Cannot allocate boot stack for application processors.");
     }
-    kmemset(bstack, 0, MAX_PROCESSORS * MEMORY_PAGESIZE);
     *(volatile uintptr_t *)(APVAR_CR3 + KERNEL_LMAP)
         = ((arch_var_t *)kvar->arch)->pgt.cr3;
     *(volatile uintptr_t *)(APVAR_SP + KERNEL_LMAP) = (uintptr_t)bstack;
@@ -1258,6 +1588,10 @@ bsp_start(void)
     kprintf("Welcome to advos (64-bit)!\r\n");
     busfreq = _estimate_bus_freq(acpi);
     kprintf("Estimated bus frequency: %lld Hz\r\n", busfreq);
+    kprintf("TSC frequency: %lld Hz (%s mode)\r\n",
+            ((arch_var_t *)kvar->arch)->clock.freq,
+            ((arch_var_t *)kvar->arch)->clock.deadline
+            ? "TSC-deadline" : "one-shot");
 
     /* Set the bus frequency */
     cpu = (struct arch_cpu_data *)CPU_TASK(lapic_id());
@@ -1295,7 +1629,8 @@ bsp_start(void)
         ent++;
     }
 
-    lapic_start_timer(busfreq, HZ, IV_LOC_TMR);
+    sched_cpu_up(lapic_id());
+    _tick_start(cpu);
     task_restart();
 
     /* The following code will never be reached... */
@@ -1344,6 +1679,7 @@ _prepare_idle_task(int lapic_id)
     at->rp->gs = GDT_RING0_DATA_SEL;
     at->rp->flags = 0x202;
     at->xregs = NULL;
+    at->fpu_counter = 0;
     at->cr3 = ((pgt_t *)g_kvar->mm.kmem.arch)->cr3;
 
     /* Set the task A as the initial task */
@@ -1380,6 +1716,16 @@ ap_start(void)
     /* Load TSS */
     tr_load(lapic_id());
 
+    /* Per-core data */
+    _percpu_init(lapic_id());
+
+    /* Write-protect the read-only pages from the kernel as well to break the
+       copy-on-write sharing on its writes */
+    wp_enable();
+
+    /* Enable the FPU/SSE state components */
+    fpu_cpu_init(&((arch_var_t *)g_kvar->arch)->fpu);
+
     /* Set the page table */
     pgt_set_cr3((pgt_t *)g_kvar->mm.kmem.arch);
 
@@ -1396,7 +1742,16 @@ ap_start(void)
         panic("Cannot initialize the idle task.");
     }
 
-    lapic_start_timer(busfreq, HZ, IV_LOC_TMR);
+    /* Setup system call as tasks may be scheduled on this processor */
+    syscall_init(g_kvar->syscalls, SYS_MAXSYSCALL);
+
+    /* Prepare the timers of this processor */
+    if ( timer_cpu_init(lapic_id()) < 0 ) {
+        panic("Failed to initialize the timer.");
+    }
+
+    sched_cpu_up(lapic_id());
+    _tick_start(cpu);
     task_restart();
 
     /* The following code will never be reached... */
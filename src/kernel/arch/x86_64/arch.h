@@ -121,30 +121,76 @@ struct arch_task {
 
     /* Kernel task (architecture-independent data structure) */
     task_t *task;
+
+    /* Number of consecutive time slices using the FPU; the context is
+       eagerly restored beyond FPU_EAGER_THRESHOLD until it wraps around */
+    uint8_t fpu_counter;
 } __attribute__ ((packed));
 
 /*
- * Processor's task information (must not exceed (256-104) bytes)
+ * Processor's task information (must not exceed (256-104) bytes).  The
+ * per-core data (CPU_DATA(i)) of the running processor is addressed through
+ * the GS base in the kernel; see percpu_read() and percpu_write().
  */
 struct arch_cpu_data {
-    /* Do not change the first three variables.  These must be on the top.  See
+    /* Do not change the first six variables.  These must be on the top.  See
        asm.S and const.h. */
     struct arch_task *cur_task;
     struct arch_task *next_task;
     struct arch_task *idle_task;
+    struct arch_cpu_data *self;
+    /* Local APIC base address */
+    uint64_t lapic_base;
+    /* User stack pointer saved at the syscall entry (scratch) */
+    uint64_t user_rsp;
+
+    /* Processor ID (local APIC ID) */
+    int id;
 
     /* FPU context */
     struct arch_task *fpu_task;
 
     /* Bus frequuency */
     uint64_t busfreq;
+
+    /* TSC at the next tick boundary */
+    uint64_t tmr_next;
+    /* Local APIC timer counts per TSC cycle (fixed point with 32-bit
+       fraction; the one-shot mode only) */
+    uint64_t tmr_mult;
 } __attribute__ ((packed));
 
 #define sfence()        __asm__ __volatile__ ("sfence")
+#define mfence()        __asm__ __volatile__ ("mfence")
+#define barrier()       __asm__ __volatile__ ("" ::: "memory")
+
+/*
+ * Typed accessors to the fields of struct arch_cpu_data of this processor
+ */
+#define PCPU_OFFSET(field)                                              \
+    (CPU_TASK_OFFSET + __builtin_offsetof(struct arch_cpu_data, field))
+#define percpu_read(field)                                              \
+    __extension__ ({                                                    \
+            __typeof__(((struct arch_cpu_data *)0)->field) __v;         \
+            __asm__ __volatile__ ("mov %%gs:%c1,%0"                     \
+                                  : "=r" (__v)                          \
+                                  : "i" (PCPU_OFFSET(field)));          \
+            __v;                                                        \
+        })
+#define percpu_write(field, val)                                        \
+    do {                                                                \
+        __typeof__(((struct arch_cpu_data *)0)->field) __v = (val);     \
+        __asm__ __volatile__ ("mov %0,%%gs:%c1"                         \
+                              :                                         \
+                              : "r" (__v), "i" (PCPU_OFFSET(field))     \
+                              : "memory");                              \
+    } while ( 0 )
+#define this_cpu()      percpu_read(self)
 
 void sti(void);
 void cli(void);
 uint64_t cpuid(uint64_t, uint64_t *, uint64_t *, uint64_t *);
+uint64_t cpuid_subleaf(uint64_t, uint64_t, uint64_t *, uint64_t *, uint64_t *);
 uint64_t rdtsc(void);
 uint64_t rdmsr(uint64_t);
 void wrmsr(uint64_t, uint64_t);
@@ -163,19 +209,26 @@ void sidt(void *);
 void lldt(uint16_t);
 void ltr(uint16_t);
 void clts(void);
+void stts(void);
+void wp_enable(void);
 void fxsave64(void *);
 void fxrstor64(void *);
 void xsave64(void *);
 void xrstor64(void *);
+void xsaveopt64(void *);
+void xsetbv(uint32_t, uint64_t);
 void hlt(void);
 void pause(void);
 
 void task_replace(void *);
 void task_restart(void);
+void task_switched(struct arch_task *, struct arch_task *);
+void task_forked(struct arch_task *);
 
 /* Interrupt handlers */
 void intr_null(void);
 void intr_apic_loc_tmr(void);
+void intr_resched(void);
 void intr_crash(void);
 void intr_de(void);
 void intr_db(void);
@@ -30,6 +30,8 @@
 #include "../../kvar.h"
 #include "pgt.h"
 #include "acpi.h"
+#include "tsc.h"
+#include "fpu.h"
 
 /*
  * Kernel variable
@@ -39,6 +41,10 @@ typedef struct {
     acpi_t *acpi;
     pgt_t pgt;
     int mp_enable;
+    /* Clock source */
+    tsc_clock_t clock;
+    /* FPU/SSE context */
+    fpu_t fpu;
 } arch_var_t;
 
 #endif
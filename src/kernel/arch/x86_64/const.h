@@ -27,6 +27,7 @@
 /* Maximum number of supported processors */
 #define MAX_PROCESSORS          128
 #define MAX_MEMORY_REGIONS      128
+#define MAX_NUMA_DOMAINS        16
 
 /* Trampoline: 0x70 (0x70000) */
 #define TRAMPOLINE_VEC          0x70
@@ -53,10 +54,12 @@
 #define CPU_DATA_BASE           0xc0060000
 #define CPU_DATA(i)             (CPU_DATA_BASE  \
                                  + ((uint64_t)(i) << CPU_DATA_SIZE_SHIFT))
-#define CPU_TSS_BASE            (CPU_DATA_BASE + 0)
+#define CPU_TSS_OFFSET          0
+#define CPU_TSS_BASE            (CPU_DATA_BASE + CPU_TSS_OFFSET)
 #define CPU_TSS(i)              (CPU_TSS_BASE   \
                                  + ((uint64_t)(i) << CPU_DATA_SIZE_SHIFT))
-#define CPU_TASK_BASE           (CPU_DATA_BASE + 104)
+#define CPU_TASK_OFFSET         104
+#define CPU_TASK_BASE           (CPU_DATA_BASE + CPU_TASK_OFFSET)
 #define CPU_TASK(i)             (CPU_TASK_BASE  \
                                  + ((uint64_t)(i) << CPU_DATA_SIZE_SHIFT))
 
@@ -69,6 +72,24 @@
 #define TASK_CUR                0
 #define TASK_NEXT               8
 #define TASK_IDLE               16
+#define TASK_SELF               24
+#define TASK_LAPIC              32
+#define TASK_URSP               40
+
+/* struct stackframe64, and the space reserved for it at the top of the kernel
+   stack while the task is in a syscall (16-byte aligned) */
+#define STACKFRAME64_SIZE       164
+#define STACKFRAME64_RESERVE    176
+
+/* Stackframe built by _syscall_entry (%rbp-relative) */
+#define SYSCALL_FRAME_RBP       0
+#define SYSCALL_FRAME_RFLAGS    8
+#define SYSCALL_FRAME_RIP       16
+#define SYSCALL_FRAME_RSP       24
+
+/* Per-core data of this processor (%gs-relative) */
+#define PCPU_TASK(off)          (CPU_TASK_OFFSET + (off))
+#define PCPU_TSS(off)           (CPU_TSS_OFFSET + (off))
 
 /* GDT selectors */
 #define GDT_NR                  7
@@ -98,13 +119,17 @@
 /* Machine-specific registers (MSRs) */
 #define MSR_APIC_BASE           0x1b
 #define MSR_PLATFORM_INFO       0xce
+#define MSR_IA32_TSC_DEADLINE   0x6e0
 #define MSR_IA32_EFER           0xc0000080
 #define MSR_IA32_STAR           0xc0000081
 #define MSR_IA32_LSTAR          0xc0000082
 #define MSR_IA32_FMASK          0xc0000084
+#define MSR_IA32_GS_BASE        0xc0000101
+#define MSR_IA32_KERNEL_GS_BASE 0xc0000102
 
 /* Interrupt vectors */
 #define IV_LOC_TMR              0x40
+#define IV_RESCHED              0x41
 #define IV_CRASH                0xfe
 
 /* TSS */
@@ -0,0 +1,124 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "arch.h"
+#include "fpu.h"
+
+/*
+ * Resolve the instructions and the size of the FPU/SSE context from CPUID
+ */
+int
+fpu_init(fpu_t *fpu)
+{
+    uint64_t rax;
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+
+    /* CPUID.01H: XSAVE=ECX[26] OSXSAVE=ECX[27] FXSR=EDX[24] */
+    cpuid(1, &rbx, &rcx, &rdx);
+    if ( !((rcx >> 26) & 1) || !((rcx >> 27) & 1) ) {
+        if ( !((rdx >> 24) & 1) ) {
+            return -1;
+        }
+        fpu->mode = FPU_FXSAVE;
+        fpu->size = FPU_FXSAVE_SIZE;
+        fpu->xcr0 = 0;
+        return 0;
+    }
+
+    /* CPUID.(EAX=0DH,ECX=0): EDX:EAX=supported components */
+    rax = cpuid_subleaf(0xd, 0, &rbx, &rcx, &rdx);
+    fpu->xcr0 = ((rdx << 32) | (rax & 0xffffffffULL)) & FPU_XCR0_MASK;
+    if ( (fpu->xcr0 & FPU_XCR0_AVX512) != FPU_XCR0_AVX512 ) {
+        /* AVX-512 requires all of its three components */
+        fpu->xcr0 &= ~FPU_XCR0_AVX512;
+    }
+    xsetbv(0, fpu->xcr0);
+
+    /* CPUID.(EAX=0DH,ECX=0): EBX=size for the components enabled in XCR0 */
+    cpuid_subleaf(0xd, 0, &rbx, &rcx, &rdx);
+    fpu->size = rbx;
+
+    /* CPUID.(EAX=0DH,ECX=1): XSAVEOPT=EAX[0] */
+    rax = cpuid_subleaf(0xd, 1, &rbx, &rcx, &rdx);
+    if ( rax & 1 ) {
+        fpu->mode = FPU_XSAVEOPT;
+    } else {
+        fpu->mode = FPU_XSAVE;
+    }
+
+    return 0;
+}
+
+/*
+ * Enable the state components on this processor
+ */
+void
+fpu_cpu_init(fpu_t *fpu)
+{
+    if ( FPU_FXSAVE != fpu->mode ) {
+        xsetbv(0, fpu->xcr0);
+    }
+}
+
+/*
+ * Save the FPU/SSE context
+ */
+void
+fpu_save(fpu_t *fpu, void *xregs)
+{
+    switch ( fpu->mode ) {
+    case FPU_XSAVEOPT:
+        xsaveopt64(xregs);
+        break;
+    case FPU_XSAVE:
+        xsave64(xregs);
+        break;
+    default:
+        fxsave64(xregs);
+    }
+}
+
+/*
+ * Restore the FPU/SSE context
+ */
+void
+fpu_restore(fpu_t *fpu, void *xregs)
+{
+    if ( FPU_FXSAVE != fpu->mode ) {
+        xrstor64(xregs);
+    } else {
+        fxrstor64(xregs);
+    }
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,79 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef _ADVOS_KERNEL_FPU_H
+#define _ADVOS_KERNEL_FPU_H
+
+#include <stdint.h>
+
+/* State components enabled in XCR0: x87, SSE, AVX, and AVX-512 */
+#define FPU_XCR0_X87            (1ULL << 0)
+#define FPU_XCR0_SSE            (1ULL << 1)
+#define FPU_XCR0_AVX            (1ULL << 2)
+#define FPU_XCR0_AVX512         (7ULL << 5)
+#define FPU_XCR0_MASK           (FPU_XCR0_X87 | FPU_XCR0_SSE | FPU_XCR0_AVX \
+                                 | FPU_XCR0_AVX512)
+
+/* Size of the legacy FXSAVE area */
+#define FPU_FXSAVE_SIZE         512
+
+/* Number of consecutive time slices using the FPU before a task switches to
+   the eager save/restore */
+#define FPU_EAGER_THRESHOLD     5
+
+/*
+ * Instructions used to save the FPU/SSE context
+ */
+typedef enum {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+} fpu_mode_t;
+
+/*
+ * FPU/SSE context management
+ */
+typedef struct {
+    fpu_mode_t mode;
+    /* Size of the save area */
+    uint32_t size;
+    /* Enabled state components */
+    uint64_t xcr0;
+} fpu_t;
+
+int fpu_init(fpu_t *);
+void fpu_cpu_init(fpu_t *);
+void fpu_save(fpu_t *, void *);
+void fpu_restore(fpu_t *, void *);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
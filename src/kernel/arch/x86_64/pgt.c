@@ -247,7 +247,7 @@ pgt_v2p(pgt_t *pgt, uintptr_t virtual)
         return (void *)MASK_SUPERPAGE(pdpt[idx].v);
     }
     /* PD */
-    p = MASK_PAGE(pdpt->v);
+    p = MASK_PAGE(pdpt[idx].v);
     idx = (virtual >> 21) & 0x1ff;
     pd = (void *)_p2v(pgt, p);
     if ( !pd[idx].ptr.present ) {
@@ -259,7 +259,7 @@ pgt_v2p(pgt_t *pgt, uintptr_t virtual)
         return (void *)MASK_SUPERPAGE(pd[idx].v);
     }
     /* PT */
-    p = MASK_PAGE(pd->v);
+    p = MASK_PAGE(pd[idx].v);
     idx = (virtual >> 12) & 0x1ff;
     pt = (void *)_p2v(pgt, p);
     if ( !pt[idx].page.present ) {
@@ -295,6 +295,39 @@ pgt_push(pgt_t *pgt, pgt_entry_t *pg)
     pgt->free = pg;
 }
 
+/*
+ * Split the superpage mapping of the PD entry into the 512 pages of a new page
+ * table with the same attributes (demotion)
+ */
+static int
+_split(pgt_t *pgt, union pgt_pd_entry *pde)
+{
+    union pgt_pt_entry *pt;
+    uintptr_t physical;
+    int i;
+
+    pt = pgt_pop(pgt);
+    if ( NULL == pt ) {
+        return -1;
+    }
+    physical = MASK_SUPERPAGE(pde->v);
+    for ( i = 0; i < 512; i++ ) {
+        pt[i].v = 0;
+        pt[i].page.present = 1;
+        pt[i].page.rw = pde->page.rw;
+        pt[i].page.us = pde->page.us;
+        pt[i].page.g = pde->page.g;
+        pt[i].v |= physical + ((uintptr_t)i << 12);
+    }
+    pde->v = 0;
+    pde->ptr.present = 1;
+    pde->ptr.rw = 1;
+    pde->ptr.us = 1;
+    pde->v |= _v2p(pgt, (uint64_t)pt);
+
+    return 0;
+}
+
 /*
  * Map the virtual address to the specified physical address
  */
@@ -386,6 +419,12 @@ pgt_map(pgt_t *pgt, uintptr_t virtual, uintptr_t physical, int superpage,
             pd[idx].ptr.us = 1;
             pd[idx].v |= _v2p(pgt, (uint64_t)pt);
         } else {
+            if ( pd[idx].ptr.page ) {
+                /* Mapped by a superpage */
+                if ( _split(pgt, &pd[idx]) < 0 ) {
+                    return -1;
+                }
+            }
             p = MASK_PAGE(pd[idx].v);
             pt = (void *)_p2v(pgt, p);
         }
@@ -462,8 +501,16 @@ pgt_unmap(pgt_t *pgt, uintptr_t virtual, int superpage)
     /* Release a superpage */
     if ( superpage ) {
         if ( !pd[idx].ptr.page ) {
-            /* Not a page */
-            return -1;
+            /* Split into pages, then release the pages with the table */
+            p = MASK_PAGE(pd[idx].v);
+            pgt_push(pgt, (void *)_p2v(pgt, p));
+            pd[idx].v = 0;
+            if ( MASK_PAGE(get_cr3()) == MASK_PAGE(pgt->cr3) ) {
+                for ( i = 0; i < 512; i++ ) {
+                    invlpg(virtual + ((uintptr_t)i << 12));
+                }
+            }
+            return 0;
         }
         pd[idx].v = 0;
 
@@ -472,6 +519,12 @@ pgt_unmap(pgt_t *pgt, uintptr_t virtual, int superpage)
             invlpg(virtual);
         }
     } else {
+        if ( pd[idx].ptr.page ) {
+            /* Mapped by a superpage */
+            if ( _split(pgt, &pd[idx]) < 0 ) {
+                return -1;
+            }
+        }
         /* PT */
         p = MASK_PAGE(pd[idx].v);
         pt = (void *)_p2v(pgt, p);
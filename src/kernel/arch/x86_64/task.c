@@ -22,9 +22,12 @@
  */
 
 #include "../../proc.h"
+#include "../../sched.h"
 #include "arch.h"
 #include "apic.h"
 #include "pgt.h"
+#include "fpu.h"
+#include "arch_var.h"
 
 /*
  * Initialize the architecture-specific task data structure
@@ -33,11 +36,13 @@ int
 task_init(task_t *t, void *entry)
 {
     struct arch_task *at;
+    fpu_t *fpu;
 
     at = t->arch;
     at->task = t;
 
-    /* Restart point (in the kernel stack) */
+    /* Restart point (in the kernel stack); N.B., _syscall_entry leaves this
+       area untouched so that execve can rebuild it from the syscall */
     at->rp = t->kstack + KSTACK_SIZE - KSTACK_GUARD
         - sizeof(struct stackframe64);
     kmemset(at->rp, 0, sizeof(struct stackframe64));
@@ -54,11 +59,14 @@ task_init(task_t *t, void *entry)
     at->rp->gs = GDT_RING3_DATA64_SEL + 3;
     at->rp->flags = 0x202;
 
-    at->xregs = kmalloc(4096);
-    kmemset(at->xregs, 0 , 4096);
-
-    /* CPUID.01H XSAVE=ECX[26] OXSAVE=ECX[27] FXSR=EDX[24] */
-    /* CPUID.0DH => XSAVE/XSTORE information */
+    /* FPU/SSE context (the zero-filled XSAVE header is the initial state) */
+    fpu = &((arch_var_t *)g_kvar->arch)->fpu;
+    at->xregs = kmalloc(fpu->size);
+    if ( NULL == at->xregs ) {
+        return -1;
+    }
+    kmemset(at->xregs, 0, fpu->size);
+    at->fpu_counter = 0;
 
     if ( NULL != t->proc ) {
         at->cr3 = ((pgt_t *)t->proc->vmem->arch)->cr3;
@@ -76,17 +84,81 @@ task_exec(task_t *t)
     task_replace(t->arch);
 }
 
+/*
+ * Called on the stack of the next task once the context switch has completed
+ */
+void
+task_switched(struct arch_task *prev, struct arch_task *next)
+{
+    int id;
+    struct arch_cpu_data *cpu;
+    fpu_t *fpu;
+
+    cpu = this_cpu();
+    id = cpu->id;
+    fpu = &((arch_var_t *)g_kvar->arch)->fpu;
+    if ( prev == cpu->idle_task ) {
+        prev = NULL;
+    }
+    if ( next == cpu->idle_task ) {
+        next = NULL;
+    }
+
+    /* The task may be resumed on another processor, so write back its FPU
+       context held by this processor */
+    if ( NULL != prev && cpu->fpu_task == prev ) {
+        clts();
+        fpu_save(fpu, prev->xregs);
+        stts();
+        cpu->fpu_task = NULL;
+    } else if ( NULL != prev ) {
+        /* Not used in this time slice */
+        prev->fpu_counter = 0;
+    }
+
+    /* Eagerly restore the context of a task repeatedly using the FPU to save
+       the #NM trap; the counter wraps around to periodically fall back to
+       the lazy switching */
+    if ( NULL != next && NULL != next->xregs
+         && next->fpu_counter > FPU_EAGER_THRESHOLD ) {
+        clts();
+        fpu_restore(fpu, next->xregs);
+        cpu->fpu_task = next;
+        next->fpu_counter++;
+    }
+
+    sched_switched(id, NULL != prev ? prev->task : NULL,
+                   NULL != next ? next->task : NULL);
+}
+
+/*
+ * Request the specified processor to reschedule
+ */
+void
+task_resched(int cpu)
+{
+    lapic_send_fixed_ipi(cpu, IV_RESCHED);
+}
+
+/*
+ * Make the forked task runnable once its stackframe is prepared (called from
+ * _sys_fork)
+ */
+void
+task_forked(struct arch_task *at)
+{
+    sched_wakeup(at->task);
+}
+
 /*
  * Get the current task
  */
 task_t *
 this_task(void)
 {
-    struct arch_cpu_data *cpu;
     struct arch_task *at;
 
-    cpu = (struct arch_cpu_data *)CPU_TASK(lapic_id());
-    at = cpu->cur_task;
+    at = percpu_read(cur_task);
 
     return at->task;
 }
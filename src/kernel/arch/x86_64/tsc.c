@@ -22,9 +22,12 @@
  */
 
 #include "arch.h"
+#include "tsc.h"
+#include "../../kconfig.h"
 
 /*
- * invariant_tsc_freq -- resolve the base frequency of invariant TSC
+ * invariant_tsc_freq -- resolve the base frequency of invariant TSC; returns 0
+ * if the TSC is not invariant or the frequency is not known
  */
 uint64_t
 tsc_invariant_freq(void)
@@ -37,20 +40,29 @@ tsc_invariant_freq(void)
     uint64_t family;
     uint64_t model;
 
-    /* Check Invariant TSC support */
+    /* Check Invariant TSC support (CPUID.80000007H:EDX[bit 8]) */
+    rax = cpuid(0x80000000, &rbx, &rcx, &rdx);
+    if ( rax < 0x80000007 ) {
+        return 0;
+    }
     cpuid(0x80000007, &rbx, &rcx, &rdx);
     if ( !(rdx & 0x100) ) {
         return 0;
     }
 
-    /* Read TSC frequency */
-    reg = (rdmsr(MSR_PLATFORM_INFO) & 0xff00) >> 8;
+    /* MSR_PLATFORM_INFO is only on Intel processors ("GenuineIntel") */
+    cpuid(0x00, &rbx, &rcx, &rdx);
+    if ( 0x756e6547 != rbx || 0x49656e69 != rdx || 0x6c65746e != rcx ) {
+        return 0;
+    }
 
     /* CPUID;EAX=0x01 */
     rax = cpuid(0x01, &rbx, &rcx, &rdx);
     family = ((rax & 0xf00) >> 8) | ((rax & 0xff00000) >> 12);
     model = ((rax & 0xf0) >> 4) | ((rax & 0xf0000) >> 12);
     if ( 0x06 == family ) {
+        /* Read TSC frequency */
+        reg = (rdmsr(MSR_PLATFORM_INFO) & 0xff00) >> 8;
         switch ( model ) {
         case 0x1e: /* Nehalem */
         case 0x1a: /* Nehalem */
@@ -76,6 +88,108 @@ tsc_invariant_freq(void)
     return 0;
 }
 
+/*
+ * Calibrate the TSC frequency against the ACPI PM timer.  Note that the caller
+ * must check the availability of the ACPI timer.
+ */
+uint64_t
+tsc_calibrate(acpi_t *acpi)
+{
+    uint64_t t0;
+    uint64_t t1;
+    uint64_t p0;
+    uint64_t prev;
+    uint64_t cur;
+    uint64_t acc;
+    uint64_t clk;
+
+    /* Probe 50 ms */
+    clk = ACPI_TMR_HZ / 20;
+
+    /* Align the start to an edge of the PM timer */
+    p0 = acpi_get_timer(acpi);
+    do {
+        prev = acpi_get_timer(acpi);
+    } while ( prev == p0 );
+    t0 = rdtsc();
+
+    acc = 0;
+    while ( acc < clk ) {
+        cur = acpi_get_timer(acpi);
+        if ( cur < prev ) {
+            /* Overflow */
+            acc += acpi_get_timer_period(acpi) + cur - prev;
+        } else {
+            acc += cur - prev;
+        }
+        prev = cur;
+    }
+    t1 = rdtsc();
+
+    return (t1 - t0) * ACPI_TMR_HZ / acc;
+}
+
+/*
+ * Check the TSC-deadline mode support of the local APIC timer
+ */
+int
+tsc_deadline_available(void)
+{
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+
+    /* CPUID.01H:ECX[bit 24] */
+    cpuid(0x01, &rbx, &rcx, &rdx);
+
+    return (rcx >> 24) & 1;
+}
+
+/*
+ * Initialize the clock source with the TSC frequency; the monotonic clock
+ * starts from now
+ */
+void
+tsc_clock_init(tsc_clock_t *clk, uint64_t freq)
+{
+    clk->freq = freq;
+    clk->base = rdtsc();
+    clk->mult = (1000000000ULL << TSC_NS_SHIFT) / freq;
+    clk->imult = (freq << TSC_CYC_SHIFT) / 1000000000ULL;
+    clk->tick = freq / HZ;
+    clk->deadline = tsc_deadline_available();
+}
+
+/*
+ * Convert a TSC value to the nanoseconds of the monotonic clock
+ */
+uint64_t
+tsc_to_ns(tsc_clock_t *clk, uint64_t tsc)
+{
+    if ( tsc < clk->base ) {
+        return 0;
+    }
+
+    return ((__uint128_t)(tsc - clk->base) * clk->mult) >> TSC_NS_SHIFT;
+}
+
+/*
+ * Convert the nanoseconds of the monotonic clock to a TSC value
+ */
+uint64_t
+tsc_from_ns(tsc_clock_t *clk, uint64_t ns)
+{
+    __uint128_t tsc;
+
+    /* Saturate far deadlines */
+    tsc = ((__uint128_t)ns * clk->imult) >> TSC_CYC_SHIFT;
+    if ( tsc >= ~0ULL - clk->base ) {
+        return ~0ULL;
+    }
+
+    return clk->base + tsc;
+}
+
 /*
  * Local variables:
  * tab-width: 4
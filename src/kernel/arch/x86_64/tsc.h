@@ -0,0 +1,69 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef _ADVOS_KERNEL_TSC_H
+#define _ADVOS_KERNEL_TSC_H
+
+#include <stdint.h>
+#include "acpi.h"
+
+/* Fixed-point shifts of the conversion factors */
+#define TSC_NS_SHIFT    32
+#define TSC_CYC_SHIFT   28
+
+/*
+ * Clock source based on the (invariant) TSC
+ */
+typedef struct {
+    /* TSC frequency in Hz */
+    uint64_t freq;
+    /* TSC value at the origin of the monotonic clock */
+    uint64_t base;
+    /* Nanoseconds per cycle (fixed point with TSC_NS_SHIFT) */
+    uint64_t mult;
+    /* Cycles per nanosecond (fixed point with TSC_CYC_SHIFT) */
+    uint64_t imult;
+    /* Cycles per tick */
+    uint64_t tick;
+    /* Whether the local APIC timer supports the TSC-deadline mode */
+    int deadline;
+} tsc_clock_t;
+
+uint64_t tsc_invariant_freq(void);
+uint64_t tsc_calibrate(acpi_t *);
+int tsc_deadline_available(void);
+void tsc_clock_init(tsc_clock_t *, uint64_t);
+uint64_t tsc_to_ns(tsc_clock_t *, uint64_t);
+uint64_t tsc_from_ns(tsc_clock_t *, uint64_t);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
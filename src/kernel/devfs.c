@@ -24,11 +24,16 @@
 #include "devfs.h"
 #include "vfs.h"
 #include "proc.h"
+#include "sched.h"
 #include "msg.h"
+#include "kvar.h"
 #include <mki/driver.h>
 
 #define DEVFS_TYPE          "devfs"
 #define SLAB_DEVFS_ENTRY    "devfs_entry"
+
+/* Slab cache for the entries */
+static memory_slab_cache_t *_entry_cache;
 #define DEVFS_FIFO_BUFSIZE  8192
 
 /*
@@ -343,7 +348,7 @@ devfs_register(const char *name, int type, proc_t *proc)
     }
 
     /* Allocate an entry */
-    e = kmem_slab_alloc(SLAB_DEVFS_ENTRY);
+    e = kmem_slab_cache_alloc(_entry_cache);
     if ( NULL == e ) {
         spin_unlock(&fs->lock);
         return -1;
@@ -387,7 +392,7 @@ devfs_unregister(int index, proc_t *proc)
         return -1;
     }
 
-    kmem_slab_free(SLAB_DEVFS_ENTRY, e);
+    kmem_slab_cache_free(_entry_cache, e);
     devfs.entries[index] = NULL;
 
     spin_unlock(&fs->lock);
@@ -571,7 +576,7 @@ devfs_read(fildes_t *fildes, void *buf, size_t nbyte)
             t->state = TASK_BLOCKED;
 
             /* Set this task to the blocking task list of the file descriptor */
-            tle = kmem_slab_alloc(SLAB_TASK_LIST);
+            tle = kmem_slab_cache_alloc(g_kvar->task_mgr.task_list_cache);
             if ( NULL == tle ) {
                 return -1;
             }
@@ -643,7 +648,7 @@ devfs_write(fildes_t *fildes, const void *buf, size_t nbyte)
         }
         /* Wake up the driver process */
         tmp = spec->entry->proc->task;
-        tmp->state = TASK_READY;
+        sched_wakeup(tmp);
         return len;
     case DEVFS_BLOCK:
         break;
@@ -678,8 +683,9 @@ devfs_init(void)
     }
 
     /* Prepare devfs slab */
-    ret = kmem_slab_create_cache(SLAB_DEVFS_ENTRY, sizeof(struct devfs_entry));
-    if ( ret < 0 ) {
+    _entry_cache = kmem_slab_create_cache(SLAB_DEVFS_ENTRY,
+                                          sizeof(struct devfs_entry), 0);
+    if ( NULL == _entry_cache ) {
         return -1;
     }
 
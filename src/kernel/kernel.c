@@ -34,6 +34,14 @@
 /* Global variable for kernel variables */
 kvar_t *g_kvar;
 
+#if defined(BENCH) && BENCH
+/* Number of objects allocated at once in the slab microbenchmark */
+#define SLAB_BENCH_BATCH        32
+
+/* Number of live allocations in the virtual memory allocator stress test */
+#define VMEM_BENCH_SLOTS        256
+#endif
+
 /*
  * kvar_init
  */
@@ -93,6 +101,110 @@ sys_print_counter(int ln, uint64_t cnt)
     print_hex(base, cnt, 8);
 }
 
+#if defined(BENCH) && BENCH
+/*
+ * Slab allocator microbenchmark (debug); allocate and free a batch of objects
+ * of the specified size nr times
+ */
+int
+sys_slab_bench(int nr, size_t size)
+{
+    void *objs[SLAB_BENCH_BATCH];
+    int i;
+    int j;
+
+    for ( i = 0; i < nr; i++ ) {
+        for ( j = 0; j < SLAB_BENCH_BATCH; j++ ) {
+            objs[j] = kmalloc(size);
+        }
+        for ( j = 0; j < SLAB_BENCH_BATCH; j++ ) {
+            kfree(objs[j]);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Virtual memory allocator stress test (debug); nr times, free a randomly
+ * chosen live allocation or allocate 1 to 32 pages (occasionally aligned to
+ * the size) into it
+ */
+int
+sys_vmem_bench(int nr)
+{
+    static const int npgs[] = { 1, 2, 3, 4, 6, 8, 16, 32 };
+    void **slots;
+    uint64_t x;
+    size_t npg;
+    int flags;
+    int i;
+    int j;
+
+    slots = kmalloc(sizeof(void *) * VMEM_BENCH_SLOTS);
+    if ( NULL == slots ) {
+        return -1;
+    }
+    kmemset(slots, 0, sizeof(void *) * VMEM_BENCH_SLOTS);
+
+    x = 1;
+    for ( i = 0; i < nr; i++ ) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        j = (x >> 33) % VMEM_BENCH_SLOTS;
+        if ( NULL != slots[j] ) {
+            memory_free_pages(&g_kvar->mm, slots[j]);
+            slots[j] = NULL;
+            continue;
+        }
+        npg = npgs[(x >> 45) & 7];
+        flags = 0;
+        if ( 0 == ((x >> 48) & 7) && 0 == (npg & (npg - 1)) ) {
+            flags = MEMORY_ALLOC_ALIGNED;
+        }
+        slots[j] = memory_alloc_pages(&g_kvar->mm, npg, MEMORY_ZONE_KERNEL, 0,
+                                      flags);
+    }
+
+    /* Release the rest */
+    for ( j = 0; j < VMEM_BENCH_SLOTS; j++ ) {
+        if ( NULL != slots[j] ) {
+            memory_free_pages(&g_kvar->mm, slots[j]);
+        }
+    }
+    kfree(slots);
+
+    return 0;
+}
+#endif
+
+/*
+ * Prepare the time page shared by all processes
+ */
+static int
+_timepage_init(void)
+{
+    void *page;
+
+    /* Allocate a physical page */
+    page = phys_mem_alloc(&g_kvar->phys, 0, MEMORY_ZONE_KERNEL, 0);
+    if ( NULL == page ) {
+        return -1;
+    }
+    g_kvar->timepage = (struct timepage *)(page + g_kvar->phys.p2v);
+    kmemset(g_kvar->timepage, 0, MEMORY_PAGESIZE);
+
+    /* Object to be mapped read-only into processes */
+    g_kvar->timepage_obj
+        = virt_memory_alloc_shared_object(&g_kvar->mm.kmem, (uintptr_t)page,
+                                          1, 0);
+    if ( NULL == g_kvar->timepage_obj ) {
+        phys_mem_free(&g_kvar->phys, page, 0, MEMORY_ZONE_KERNEL, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Initialize the kernel
  */
@@ -108,7 +220,7 @@ kernel_init(void)
     /* Allocate memory for system calls */
     sz = sizeof(void *) * SYS_MAXSYSCALL;
     nr = (sz + MEMORY_PAGESIZE - 1) >> MEMORY_PAGESIZE_SHIFT;
-    syscalls = memory_alloc_pages(&g_kvar->mm, nr, MEMORY_ZONE_KERNEL, 0);
+    syscalls = memory_alloc_pages(&g_kvar->mm, nr, MEMORY_ZONE_KERNEL, 0, 0);
     if ( NULL == syscalls ) {
         return -1;
     }
@@ -123,15 +235,22 @@ kernel_init(void)
     syscalls[SYS_write] = sys_write;
     syscalls[SYS_execve] = sys_execve;
     syscalls[SYS_nanosleep] = sys_nanosleep;
+    syscalls[SYS_getpriority] = sys_getpriority;
+    syscalls[SYS_setpriority] = sys_setpriority;
     syscalls[SYS_initexec] = sys_initexec;
     syscalls[SYS_driver] = sys_driver;
+    syscalls[SYS_set_mempolicy] = sys_set_mempolicy;
     syscalls[766] = sys_print_counter;
+#if defined(BENCH) && BENCH
+    syscalls[767] = sys_slab_bench;
+    syscalls[765] = sys_vmem_bench;
+#endif
 
     /* Set the table to the kernel variable */
     g_kvar->syscalls = syscalls;
 
-    /* Create slab for event */
-    ret = kmem_slab_create_cache("timer_event", sizeof(timer_event_t));
+    /* Prepare the time page */
+    ret = _timepage_init();
     if ( ret < 0 ) {
         return -1;
     }
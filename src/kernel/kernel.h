@@ -56,12 +56,14 @@ void panic(const char *, ...);
 void hlt(void);
 void spin_lock(int *);
 void spin_unlock(int *);
+int spin_trylock(int *);
 uint8_t in8(uint16_t);
 uint16_t in16(uint16_t);
 uint32_t in32(uint16_t);
 void out8(uint16_t, uint8_t);
 void out16(uint16_t, uint16_t);
 void out32(uint16_t, uint32_t);
+int this_cpu_id(void);
 
 #define kassert(cond)        do {                                       \
         char buf[4096];                                                 \
@@ -74,6 +76,7 @@ void out32(uint16_t, uint32_t);
 
 /* Defined in arch/x86_64/asm.S */
 void * kmemset(void *, int, size_t);
+void * kmemzero_nt(void *, size_t);
 int kmemcmp(void *, void *, size_t);
 int kmemcpy(void *__restrict, const void *__restrict, size_t);
 int kmemmove(void *, void *, size_t);
@@ -102,8 +105,11 @@ int sys_execve(const char *, char *const [], char *const []);
 int sys_open(const char *, int, ...);
 void * sys_mmap(void *, size_t, int, int, int, off_t);
 int sys_nanosleep(const struct timespec *, struct timespec *);
+int sys_getpriority(int, id_t);
+int sys_setpriority(int, id_t, int);
 int sys_initexec(const char *, char *const[], char *const[]);
 int sys_driver(int, void *);
+int sys_set_mempolicy(int, int);
 
 #endif
 
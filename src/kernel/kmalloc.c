@@ -27,7 +27,16 @@
 static int kmalloc_sizes[] = { 8, 16, 32, 64, 96, 128, 192, 256, 512, 1024,
                                2048, 4096, 8192 };
 
+#define KMALLOC_NR_SIZES    (int)(sizeof(kmalloc_sizes) / sizeof(int))
+
+/* Sizes up to KMALLOC_SMALL_MAX are resolved by the table in 8-byte steps,
+   and the larger ones (powers of two) by the most significant bit */
+#define KMALLOC_SMALL_MAX   192
+#define KMALLOC_LARGE_BASE  7   /* Index of 256 = 1 << 8 */
+
 static memory_slab_allocator_t *_slab;
+static memory_slab_cache_t *_caches[KMALLOC_NR_SIZES];
+static uint8_t _small_index[KMALLOC_SMALL_MAX / 8 + 1];
 
 /*
  * Initialize kmalloc()
@@ -36,20 +45,31 @@ int
 kmalloc_init(memory_slab_allocator_t *slab)
 {
     int i;
-    int ret;
+    int j;
     char cachename[MEMORY_SLAB_CACHE_NAME_MAX];
 
     _slab = slab;
 
     /* Initialize the kmalloc slab caches */
-    for ( i = 0; i < (int)(sizeof(kmalloc_sizes) / sizeof(int)); i++ ) {
+    for ( i = 0; i < KMALLOC_NR_SIZES; i++ ) {
         ksnprintf(cachename, MEMORY_SLAB_CACHE_NAME_MAX, "kmalloc-%d",
                   kmalloc_sizes[i]);
-        ret = memory_slab_create_cache(slab, cachename, kmalloc_sizes[i]);
-        if ( ret < 0 ) {
+        _caches[i] = memory_slab_create_cache(slab, cachename,
+                                              kmalloc_sizes[i], 0);
+        if ( NULL == _caches[i] ) {
             return -1;
         }
     }
+
+    /* Build the size-to-class table for the small sizes */
+    j = 0;
+    for ( i = 0; i <= KMALLOC_SMALL_MAX / 8; i++ ) {
+        while ( kmalloc_sizes[j] < i * 8 ) {
+            j++;
+        }
+        _small_index[i] = j;
+    }
+
     return 0;
 }
 
@@ -59,26 +79,19 @@ kmalloc_init(memory_slab_allocator_t *slab)
 void *
 kmalloc(size_t sz)
 {
-    char cachename[MEMORY_SLAB_CACHE_NAME_MAX];
-    size_t i;
-    int aligned_size;
-
-    /* Search fitting size */
-    aligned_size = -1;
-    for ( i = 0; i < sizeof(kmalloc_sizes) / sizeof(int); i++ ) {
-        if ( (int)sz <= kmalloc_sizes[i] ) {
-            aligned_size = kmalloc_sizes[i];
-            break;
-        }
-    }
-    if ( aligned_size < 0 ) {
+    int i;
+
+    if ( sz <= KMALLOC_SMALL_MAX ) {
+        i = _small_index[(sz + 7) >> 3];
+    } else if ( sz <= (size_t)kmalloc_sizes[KMALLOC_NR_SIZES - 1] ) {
+        /* Index of the power of two not smaller than sz */
+        i = KMALLOC_LARGE_BASE + (63 - __builtin_clzll(sz - 1)) - 7;
+    } else {
         /* The requested size is too large. */
         return NULL;
     }
-    ksnprintf(cachename, MEMORY_SLAB_CACHE_NAME_MAX, "kmalloc-%d",
-              aligned_size);
 
-    return memory_slab_alloc(_slab, cachename);
+    return memory_slab_cache_alloc(_slab, _caches[i]);
 }
 
 /*
@@ -87,20 +100,12 @@ kmalloc(size_t sz)
 void
 kfree(void *obj)
 {
-    int ret;
-    char cachename[MEMORY_SLAB_CACHE_NAME_MAX];
-    size_t i;
-
-    /* Search the slab cache name corresponding to the object */
-    for ( i = 0; i < sizeof(kmalloc_sizes) / sizeof(int); i++ ) {
-        ksnprintf(cachename, MEMORY_SLAB_CACHE_NAME_MAX, "kmalloc-%d",
-                  kmalloc_sizes[i]);
-        ret = memory_slab_free(_slab, cachename, obj);
-        if ( 0 == ret ) {
-            /* Found */
-            break;
-        }
+    if ( NULL == obj ) {
+        return;
     }
+
+    /* The cache is resolved from the slab header of the object */
+    memory_slab_cache_free(_slab, memory_slab_object_cache(obj), obj);
 }
 
 /*
@@ -94,6 +94,9 @@ kmem_init(virt_memory_t *kmem, phys_memory_t *phys, uintptr_t p2v)
     kmem->allocator.free = kmem_data_free;
 
     kmem->flags = 0;
+    kmem->policy.mode = MEMORY_POLICY_LOCAL;
+    kmem->policy.domain = 0;
+    kmem->policy.next = 0;
 
     return 0;
 }
@@ -116,10 +119,20 @@ kmem_slab_free(const char *name, void *obj)
 {
     return memory_slab_free(&g_kvar->slab, name, obj);
 }
+void *
+kmem_slab_cache_alloc(memory_slab_cache_t *c)
+{
+    return memory_slab_cache_alloc(&g_kvar->slab, c);
+}
 int
-kmem_slab_create_cache(const char *name, size_t size)
+kmem_slab_cache_free(memory_slab_cache_t *c, void *obj)
+{
+    return memory_slab_cache_free(&g_kvar->slab, c, obj);
+}
+memory_slab_cache_t *
+kmem_slab_create_cache(const char *name, size_t size, int flags)
 {
-    return memory_slab_create_cache(&g_kvar->slab, name, size);
+    return memory_slab_create_cache(&g_kvar->slab, name, size, flags);
 }
 
 /*
@@ -30,7 +30,9 @@
 #include "proc.h"
 #include "vfs.h"
 #include "timer.h"
+#include "sched.h"
 #include <sys/syscall.h>
+#include <advos/timepage.h>
 
 /*
  * Kernel variable
@@ -42,10 +44,12 @@ typedef struct {
     void **syscalls;
     console_t console;
     proc_t **procs;
-    task_t *runqueue;
+    sched_t sched;
     task_mgr_t task_mgr;
-    uint64_t jiffies;
-    timer_event_t *timer;
+    timer_mgr_t timer;
+    /* Time page shared by all processes (read-only for them) */
+    struct timepage *timepage;
+    virt_memory_object_t *timepage_obj;
     vfs_vnode_t *rootfs;
     /* Architecture specific data */
     void *arch;
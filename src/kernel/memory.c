@@ -25,21 +25,12 @@
 #include "kernel.h"
 
 /*
- * Structures for btree search conditions
+ * Structure for the fork
  */
-struct virt_memory_start_end {
-    uintptr_t start;
-    uintptr_t end;
-};
-
-struct virt_memory_size {
-    size_t size;
-    virt_memory_free_t *ret;
-};
-
 struct virt_memory_fork_cache {
     virt_memory_object_t *orig;
     virt_memory_object_t *object;
+    virt_memory_object_t *parent;
 };
 
 /*
@@ -50,7 +41,8 @@ static int _free_add(virt_memory_block_t *, virt_memory_free_t *);
 static virt_memory_free_t *
 _free_delete(virt_memory_block_t *, virt_memory_free_t *);
 static void *
-_alloc_pages_block(virt_memory_t *, virt_memory_block_t *, size_t, int, int);
+_alloc_pages_block(virt_memory_t *, virt_memory_block_t *, size_t, int, int,
+                   int);
 
 /*
  * Initialize virtual memory
@@ -70,6 +62,7 @@ memory_init(memory_t *mem, phys_memory_t *phys, void *arch, uintptr_t p2v,
     mem->phys = phys;
     mem->kmem.blocks = NULL;
     mem->kmem.mem = mem;
+    mem->lock = 0;
 
     /* Architecture specific data structure */
     mem->kmem.arch = arch;
@@ -107,28 +100,6 @@ virt_memory_comp_addr(void *a, void *b)
     }
 }
 
-/*
- * Compare the size
- */
-int
-virt_memory_comp_size(void *a, void *b)
-{
-    virt_memory_free_t *va;
-    virt_memory_free_t *vb;
-
-    /* Cast */
-    va = (virt_memory_free_t *)a;
-    vb = (virt_memory_free_t *)b;
-
-    if ( va->size == vb->size ) {
-        return 0;
-    } else if ( va->size > vb->size ) {
-        return 1;
-    } else {
-        return -1;
-    }
-}
-
 /*
  * Search condition for a fitting entry
  */
@@ -183,59 +154,6 @@ virt_memory_cond_fit_free(void *a, void *data)
     }
 }
 
-/*
- * Search condition for a fitting free entry by size
- */
-int
-virt_memory_cond_fit_free_size(void *a, void *data)
-{
-    virt_memory_free_t *va;
-    struct virt_memory_size *sz;
-
-    /* Cast */
-    va = (virt_memory_free_t *)a;
-    sz = (struct virt_memory_size *)data;
-
-    if ( sz->size > va->size ) {
-        /* Search the right subtree */
-        return 1;
-    } else {
-        /* Search the left subtree */
-        sz->ret = va;
-        return -1;
-    }
-}
-
-/*
- * Search condition for a neighboring free entry
- */
-int
-virt_memory_cond_neigh_free(void *a, void *data)
-{
-    virt_memory_free_t *va;
-    uintptr_t start;
-    uintptr_t end;
-    struct virt_memory_start_end *se;
-
-    /* Cast */
-    va = (virt_memory_free_t *)a;
-    se = (struct virt_memory_start_end *)data;
-    start = se->start;
-    end = se->end;
-
-    if ( end == va->start || start == va->start + va->size ) {
-        /* Found */
-        return 0;
-    }
-    if ( start < va->start ) {
-        /* Search the left */
-        return -1;
-    } else {
-        /* Search the right */
-        return 1;
-    }
-}
-
 /*
  * Insert a memory block to the specified virtual memory
  */
@@ -299,27 +217,6 @@ _find_free_entry(virt_memory_block_t *b, uintptr_t addr)
     return n->data;
 }
 
-/*
- * Find a free entry neighboring to the start and the end
- */
-static virt_memory_free_t *
-_find_neighbor_free_entry(virt_memory_block_t *b, uintptr_t start,
-                          uintptr_t end)
-{
-    btree_node_t *n;
-    struct virt_memory_start_end sn;
-
-    sn.start = start;
-    sn.end = end;
-    n = btree_search(b->frees.atree, (void *)&sn, virt_memory_cond_neigh_free);
-    if ( NULL == n ) {
-        return NULL;
-    }
-
-    return n->data;
-
-}
-
 /*
  * Add an entry
  */
@@ -380,30 +277,41 @@ _order(uintptr_t addr1, uintptr_t addr2, size_t size)
     return order;
 }
 
+/*
+ * Update the maximum size of the free spaces in the subtree
+ */
+static void
+_free_update(btree_node_t *n)
+{
+    virt_memory_free_t *f;
+    virt_memory_free_t *c;
+
+    f = n->data;
+    f->max = f->size;
+    if ( NULL != n->left ) {
+        c = n->left->data;
+        if ( c->max > f->max ) {
+            f->max = c->max;
+        }
+    }
+    if ( NULL != n->right ) {
+        c = n->right->data;
+        if ( c->max > f->max ) {
+            f->max = c->max;
+        }
+    }
+}
+
 /*
  * Add a node to the free entry tree
  */
 static int
 _free_add(virt_memory_block_t *b, virt_memory_free_t *n)
 {
-    int ret;
-    void *p;
-
     n->atree.data = n;
-    n->stree.data = n;
-
-    ret = btree_add(&b->frees.atree, &n->atree, virt_memory_comp_addr, 0);
-    if ( ret < 0 ) {
-        return -1;
-    }
-    ret = btree_add(&b->frees.stree, &n->stree, virt_memory_comp_size, 1);
-    if ( ret < 0 ) {
-        p = btree_delete(&b->frees.atree, &n->atree, virt_memory_comp_addr);
-        kassert( p != NULL );
-        return -1;
-    }
 
-    return 0;
+    return btree_add_augmented(&b->frees.atree, &n->atree,
+                               virt_memory_comp_addr, 0, _free_update);
 }
 
 /*
@@ -413,32 +321,77 @@ static virt_memory_free_t *
 _free_delete(virt_memory_block_t *b, virt_memory_free_t *n)
 {
     btree_node_t *fa;
-    btree_node_t *fs;
 
-    fa = btree_delete(&b->frees.atree, &n->atree, virt_memory_comp_addr);
-    fs = btree_delete(&b->frees.stree, &n->stree, virt_memory_comp_size);
-    kassert( fa != NULL && fs != NULL );
-    kassert( fa->data == fs->data );
+    fa = btree_delete_augmented(&b->frees.atree, &n->atree,
+                                virt_memory_comp_addr, _free_update);
+    kassert( fa != NULL );
 
     return fa->data;
 }
 
 /*
- * Search the tree by size
+ * Search the lowest free space that holds size bytes from an address aligned
+ * to align in the subtrees whose maximum free space is not smaller than bound
+ */
+static virt_memory_free_t *
+_search_fit_bound(virt_memory_block_t *block, size_t size, size_t align,
+                  size_t bound)
+{
+    btree_node_t *stack[BTREE_MAX_HEIGHT];
+    btree_node_t *n;
+    virt_memory_free_t *f;
+    uintptr_t start;
+    int sp;
+
+    /* In-order traversal from the lowest address */
+    sp = 0;
+    n = block->frees.atree;
+    while ( NULL != n || sp > 0 ) {
+        if ( NULL != n ) {
+            if ( ((virt_memory_free_t *)n->data)->max < bound ) {
+                /* No space fits in this subtree */
+                n = NULL;
+                continue;
+            }
+            stack[sp++] = n;
+            n = n->left;
+            continue;
+        }
+        n = stack[--sp];
+        f = n->data;
+        if ( f->size >= size ) {
+            start = (f->start + (align - 1)) & ~(uintptr_t)(align - 1);
+            if ( start + size <= f->start + f->size ) {
+                return f;
+            }
+        }
+        n = n->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Search a free space that holds size bytes from an address aligned to align
+ * (the page size if zero).  Any space of size + align - MEMORY_PAGESIZE bytes
+ * holds it, so the lowest one is searched first in logarithmic time.  Smaller
+ * spaces are searched only if not found; that may take linear time as the
+ * alignment of a space is not known until visited.
  */
 static virt_memory_free_t *
-_search_fit_size(virt_memory_block_t *block, size_t sz)
+_search_fit(virt_memory_block_t *block, size_t size, size_t align)
 {
-    struct virt_memory_size r;
+    virt_memory_free_t *f;
 
-    r.size = sz;
-    r.ret = NULL;
-    btree_search(block->frees.stree, &r, virt_memory_cond_fit_free_size);
-    if ( NULL == r.ret ) {
-        return NULL;
+    if ( 0 == align ) {
+        align = MEMORY_PAGESIZE;
+    }
+    f = _search_fit_bound(block, size, align, size + align - MEMORY_PAGESIZE);
+    if ( NULL == f && align > MEMORY_PAGESIZE ) {
+        f = _search_fit_bound(block, size, align, size);
     }
 
-    return r.ret;
+    return f;
 }
 
 /*
@@ -457,160 +410,317 @@ virt_memory_alloc_object(virt_memory_t *vmem, size_t size)
     obj->size = size;
     obj->pages = NULL;
     obj->refs = 0;
+    obj->populated = NULL;
+    obj->lock = 0;
 
     return obj;
 }
 
 /*
- * Allocate pages for the specified range
+ * Allocate a shadow object of the specified object; the pages written are
+ * copied to the shadow object and the others are looked up from the backing
+ * object (copy-on-write)
  */
-static int
-_alloc_pages(virt_memory_t *vmem, virt_memory_entry_t *e)
+static virt_memory_object_t *
+_alloc_shadow(virt_memory_t *vmem, virt_memory_object_t *backing)
 {
-    page_t *p;
-    page_t **pp;
-    page_t **savepp;
-    int ret;
-    size_t nr;
-    size_t off;
-    size_t i;
-    void *r;
-    int flags;
-    uintptr_t virtual;
+    virt_memory_object_t *obj;
 
-    /* # of pages */
-    nr = e->size / MEMORY_PAGESIZE;
-    off = e->offset / MEMORY_PAGESIZE;
+    obj = virt_memory_alloc_object(vmem, backing->size);
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    obj->type = MEMORY_SHADOW;
+    obj->u.shadow.object = backing;
+    spin_lock(&backing->lock);
+    backing->refs++;
+    spin_unlock(&backing->lock);
 
-    /* Search the insertion position, and make sure the pages for this region
-       are not allocated */
-    ret = 0;
-    pp = &e->object->pages;
-    p = e->object->pages;
-    while ( NULL != p ) {
-        if ( p->index < off ) {
-            pp = &p->next;
-        } else if ( p->index < off + nr ) {
-            /* off <= p->index < off + nr */
-            ret = -1;
-            break;
-        } else {
-            break;
-        }
-        p = p->next;
+    return obj;
+}
+
+/*
+ * Get the backing object of the object
+ */
+static __inline__ virt_memory_object_t *
+_backing_object(virt_memory_object_t *obj)
+{
+    if ( MEMORY_SHADOW == obj->type ) {
+        return obj->u.shadow.object;
     }
-    if ( ret < 0 ) {
-        return -1;
+    return NULL;
+}
+
+/*
+ * Check if the 2^order pages from the index of the object are within the range
+ * of the entry at the virtual address aligned to their size (i.e., mappable as
+ * a superpage)
+ */
+static __inline__ int
+_in_entry(virt_memory_entry_t *e, uintptr_t index, int order)
+{
+    uintptr_t virtual;
+
+    if ( index * MEMORY_PAGESIZE < (uintptr_t)e->offset
+         || (index + ((uintptr_t)1 << order)) * MEMORY_PAGESIZE
+         > (uintptr_t)e->offset + e->size ) {
+        return 0;
     }
+    virtual = e->start + index * MEMORY_PAGESIZE - e->offset;
 
-    /* Allocate and map pages */
-    savepp = pp;
-    virtual = e->start;
+    return 0 == (virtual & ((MEMORY_PAGESIZE << order) - 1));
+}
+
+/*
+ * Allocate an object on the wired physical pages shared by multiple virtual
+ * memory spaces (mapped with MEMORY_VMF_SHARED; the pages are never copied
+ * nor released).  The creator holds a reference.
+ */
+virt_memory_object_t *
+virt_memory_alloc_shared_object(virt_memory_t *vmem, uintptr_t physical,
+                                size_t nr, int flags)
+{
+    virt_memory_object_t *obj;
+    page_t *p;
+    page_t **pp;
+    size_t i;
+
+    obj = virt_memory_alloc_object(vmem, nr * MEMORY_PAGESIZE);
+    if ( NULL == obj ) {
+        return NULL;
+    }
+    pp = &obj->pages;
     for ( i = 0; i < nr; i++ ) {
         p = (page_t *)vmem->allocator.alloc(vmem);
         if ( NULL == p ) {
-            goto error_page;
+            goto error;
         }
-        p->index = off + i;
-        p->zone = MEMORY_ZONE_NUMA_AWARE;
+        p->index = i;
+        p->physical = physical + i * MEMORY_PAGESIZE;
+        p->zone = MEMORY_ZONE_KERNEL;
         p->numadomain = 0;
-        p->flags = 0;
-        if ( e->flags & MEMORY_VMF_RW ) {
-            p->flags |= MEMORY_PGF_RW;
-        }
+        p->flags = MEMORY_PGF_WIRED | flags;
         p->order = 0;
         p->next = NULL;
-
-        /* Allocate a physical page */
-        r = phys_mem_alloc(vmem->mem->phys, p->order, p->zone, p->numadomain);
-        if ( NULL == r ) {
-            vmem->allocator.free(vmem, (void *)p);
-            goto error_page;
-        }
-        p->physical = (uintptr_t)r;
-
-        /* Map */
-        flags = vmem->flags;
-        ret = vmem->mem->ifs.map(vmem->arch, virtual, p, flags);
-        if ( ret < 0 ) {
-            vmem->allocator.free(vmem, (void *)p);
-            phys_mem_free(vmem->mem->phys, (void *)p->physical, p->order,
-                          p->zone, p->numadomain);
-            goto error_page;
-        }
-
-        virtual += MEMORY_PAGESIZE;
         *pp = p;
         pp = &p->next;
     }
+    obj->refs = 1;
 
-    return 0;
+    return obj;
 
-error_page:
-    p = *savepp;
-    virtual = e->start;
-    for ( ; i--; i > 0 ) {
-        ret = vmem->mem->ifs.unmap(vmem->arch, virtual, p);
-        kassert(ret == 0);
-        virtual += MEMORY_PAGESIZE;
+error:
+    while ( NULL != obj->pages ) {
+        p = obj->pages;
+        obj->pages = p->next;
         vmem->allocator.free(vmem, (void *)p);
-        p = p->next;
     }
-    *savepp = p;
+    vmem->allocator.free(vmem, (void *)obj);
 
-    return -1;
+    return NULL;
 }
 
 /*
- * Allocate an entry
+ * Map the pages of the shared object for the specified range
  */
-virt_memory_entry_t *
-virt_memory_alloc_entry(virt_memory_t *vmem, virt_memory_object_t *obj,
-                        uintptr_t addr, size_t size, off_t offset, int flags)
+static int
+_map_shared_pages(virt_memory_t *vmem, virt_memory_entry_t *e)
 {
-    virt_memory_entry_t *e;
-    virt_memory_free_t *f;
-    virt_memory_block_t *b;
-    virt_memory_free_t *f0;
-    virt_memory_free_t *f1;
+    page_t *p;
+    page_t *q;
+    size_t nr;
+    size_t off;
     int ret;
 
-    /* Page alignment check */
-    if ( addr & (MEMORY_PAGESIZE - 1) ) {
-        return NULL;
-    }
-    if ( size & (MEMORY_PAGESIZE - 1) ) {
-        return NULL;
-    }
-    if ( offset & (MEMORY_PAGESIZE - 1) ) {
-        return NULL;
-    }
+    nr = e->size / MEMORY_PAGESIZE;
+    off = e->offset / MEMORY_PAGESIZE;
 
-    /* Find a block including the virtual address */
-    b = _find_block(vmem, addr);
-    if ( NULL == b ) {
-        /* Not found */
-        return NULL;
+    for ( p = e->object->pages; NULL != p; p = p->next ) {
+        if ( p->index < off || p->index >= off + nr ) {
+            continue;
+        }
+        ret = vmem->mem->ifs.map(vmem->arch, e->start
+                                 + (p->index - off) * MEMORY_PAGESIZE, p,
+                                 vmem->flags);
+        if ( ret < 0 ) {
+            goto error;
+        }
     }
 
-    /* Find a free space corresponding to the virtual address */
-    f = _find_free_entry(b, addr);
-    if ( NULL == f ) {
-        /* Not found */
-        return NULL;
-    }
+    return 0;
 
-    /* Check the entry size */
-    if ( addr + size > f->start + f->size ) {
-        /* The end address exceeds the range of the found entry */
-        return NULL;
+error:
+    /* Unmap the pages mapped before the failure */
+    for ( q = e->object->pages; q != p; q = q->next ) {
+        if ( q->index < off || q->index >= off + nr ) {
+            continue;
+        }
+        ret = vmem->mem->ifs.unmap(vmem->arch, e->start
+                                   + (q->index - off) * MEMORY_PAGESIZE, q);
+        kassert(ret == 0);
     }
 
-    /* Check the object size */
-    if ( offset + size > obj->size ) {
-        /* Exceed the range of the object */
-        return NULL;
-    }
+    return -1;
+}
+
+/*
+ * Map the pages visible through the shadow object read-only for the specified
+ * range; the pages in the upper objects hide those of the same index below
+ */
+static int
+_map_cow_pages(virt_memory_t *vmem, virt_memory_entry_t *e)
+{
+    virt_memory_object_t *obj;
+    virt_memory_object_t *prev;
+    page_t *p;
+    size_t off;
+    uintptr_t virtual;
+    int ret;
+
+    off = e->offset / MEMORY_PAGESIZE;
+
+    /* Lock the chain hand over hand not to be collapsed under the walk */
+    prev = NULL;
+    for ( obj = e->object; NULL != obj; obj = _backing_object(obj) ) {
+        spin_lock(&obj->lock);
+        if ( NULL != prev ) {
+            spin_unlock(&prev->lock);
+        }
+        prev = obj;
+        for ( p = obj->pages; NULL != p; p = p->next ) {
+            if ( !_in_entry(e, p->index, p->order) ) {
+                /* Including superpages not aligned in this entry (mapped by
+                   pages on faults) */
+                continue;
+            }
+            virtual = e->start + (p->index - off) * MEMORY_PAGESIZE;
+            if ( vmem->mem->ifs.v2p(vmem->arch, (void *)virtual) ) {
+                /* Already mapped from an upper object */
+                continue;
+            }
+            ret = vmem->mem->ifs.map(vmem->arch, virtual, p,
+                                     vmem->flags | MEMORY_VMF_COW);
+            if ( ret < 0 ) {
+                spin_unlock(&obj->lock);
+                return -1;
+            }
+        }
+    }
+    if ( NULL != prev ) {
+        spin_unlock(&prev->lock);
+    }
+
+    return 0;
+}
+
+/*
+ * Remap the writable pages of the object read-only for the specified range to
+ * share them with a forked process
+ */
+static void
+_protect_pages(virt_memory_t *vmem, virt_memory_entry_t *e)
+{
+    page_t *p;
+    size_t off;
+    uintptr_t virtual;
+    int ret;
+
+    off = e->offset / MEMORY_PAGESIZE;
+
+    /* The pages of the backing objects are already mapped read-only */
+    spin_lock(&e->object->lock);
+    for ( p = e->object->pages; NULL != p; p = p->next ) {
+        if ( !_in_entry(e, p->index, p->order)
+             || !(p->flags & MEMORY_PGF_RW) ) {
+            continue;
+        }
+        virtual = e->start + (p->index - off) * MEMORY_PAGESIZE;
+        ret = vmem->mem->ifs.unmap(vmem->arch, virtual, p);
+        kassert(ret == 0);
+        /* Remapping the page just unmapped does not need a new table */
+        ret = vmem->mem->ifs.map(vmem->arch, virtual, p,
+                                 vmem->flags | MEMORY_VMF_COW);
+        kassert(ret == 0);
+    }
+    spin_unlock(&e->object->lock);
+}
+
+/*
+ * Allocate a physical block for the page with MEMORY_ALLOC_* flags; the domain
+ * of the NUMA-aware zone is resolved by the memory policy if MEMORY_DOMAIN_ANY
+ * is specified
+ */
+static void *
+_page_alloc(virt_memory_t *vmem, page_t *p, int flags)
+{
+    void *r;
+    int domain;
+
+    if ( MEMORY_ZONE_NUMA_AWARE == p->zone
+         && MEMORY_DOMAIN_ANY == (int)p->numadomain ) {
+        r = phys_mem_alloc_policy(vmem->mem->phys, p->order, &vmem->policy,
+                                  flags, &domain);
+        p->numadomain = domain;
+        return r;
+    }
+
+    if ( flags & MEMORY_ALLOC_ZEROED ) {
+        return phys_mem_alloc_zeroed(vmem->mem->phys, p->order, p->zone,
+                                     p->numadomain);
+    }
+    return phys_mem_alloc(vmem->mem->phys, p->order, p->zone, p->numadomain);
+}
+
+/*
+ * Allocate an entry
+ */
+virt_memory_entry_t *
+virt_memory_alloc_entry(virt_memory_t *vmem, virt_memory_object_t *obj,
+                        uintptr_t addr, size_t size, off_t offset, int flags)
+{
+    virt_memory_entry_t *e;
+    virt_memory_free_t *f;
+    virt_memory_block_t *b;
+    virt_memory_free_t *f0;
+    virt_memory_free_t *f1;
+    int ret;
+
+    /* Page alignment check */
+    if ( addr & (MEMORY_PAGESIZE - 1) ) {
+        return NULL;
+    }
+    if ( size & (MEMORY_PAGESIZE - 1) ) {
+        return NULL;
+    }
+    if ( offset & (MEMORY_PAGESIZE - 1) ) {
+        return NULL;
+    }
+
+    /* Find a block including the virtual address */
+    b = _find_block(vmem, addr);
+    if ( NULL == b ) {
+        /* Not found */
+        return NULL;
+    }
+
+    /* Find a free space corresponding to the virtual address */
+    f = _find_free_entry(b, addr);
+    if ( NULL == f ) {
+        /* Not found */
+        return NULL;
+    }
+
+    /* Check the entry size */
+    if ( addr + size > f->start + f->size ) {
+        /* The end address exceeds the range of the found entry */
+        return NULL;
+    }
+
+    /* Check the object size */
+    if ( offset + size > obj->size ) {
+        /* Exceed the range of the object */
+        return NULL;
+    }
 
     /* Prepare an entry */
     e = (virt_memory_entry_t *)vmem->allocator.alloc(vmem);
@@ -620,7 +730,9 @@ virt_memory_alloc_entry(virt_memory_t *vmem, virt_memory_object_t *obj,
     e->start = addr;
     e->size = size;
     e->offset = offset;
+    spin_lock(&obj->lock);
     obj->refs++;
+    spin_unlock(&obj->lock);
     e->object = obj;
     e->flags = flags;
 
@@ -667,7 +779,7 @@ virt_memory_alloc_entry(virt_memory_t *vmem, virt_memory_object_t *obj,
         vmem->allocator.free(vmem, (void *)f1);
     } else {
         f0->start = f->start;
-        f0->size = e->start + e->size - f->start;
+        f0->size = e->start - f->start;
         f1->start = e->start + e->size;
         f1->size = f->start + f->size - f1->start;
         ret = _free_add(b, f0);
@@ -681,8 +793,16 @@ virt_memory_alloc_entry(virt_memory_t *vmem, virt_memory_object_t *obj,
     }
     vmem->allocator.free(vmem, (void *)f);
 
-    /* Allocate pages by static allocation pager (no paging) */
-    ret = _alloc_pages(vmem, e);
+    if ( flags & MEMORY_VMF_SHARED ) {
+        /* Map the pages of the shared object */
+        ret = _map_shared_pages(vmem, e);
+    } else if ( flags & MEMORY_VMF_COW ) {
+        /* Share the pages of the backing objects read-only */
+        ret = _map_cow_pages(vmem, e);
+    } else {
+        /* The pages are allocated on the first touch (virt_memory_fault()) */
+        ret = 0;
+    }
     if ( ret < 0 ) {
         return NULL;
     }
@@ -700,20 +820,22 @@ error_entry:
 error_f1:
     vmem->allocator.free(vmem, (void *)f0);
 error_f0:
+    spin_lock(&obj->lock);
     obj->refs--;
+    spin_unlock(&obj->lock);
     vmem->allocator.free(vmem, (void *)e);
 
     return NULL;
 }
 
 /*
- * Allocate pages from the block
+ * Allocate pages from the block with MEMORY_ALLOC_* flags
  */
 static void *
 _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
-                   int zone, int numadomain)
+                   int zone, int numadomain, int aflags)
 {
-    int superpage;
+    size_t align;
     size_t size;
     virt_memory_free_t *f;
     virt_memory_free_t *f0;
@@ -729,13 +851,13 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
 
     /* Search from the binary tree */
     size = nr * MEMORY_PAGESIZE;
-    superpage = 0;
+    align = 0;
     if ( size >= MEMORY_SUPERPAGESIZE ) {
-        /* Search larger size to make sure to align superpages */
-        size += MEMORY_SUPERPAGESIZE;
-        superpage = 1;
+        align = MEMORY_SUPERPAGESIZE;
+    } else if ( aflags & MEMORY_ALLOC_ALIGNED ) {
+        align = size;
     }
-    f = _search_fit_size(block, size);
+    f = _search_fit(block, size, align);
     if ( NULL == f ) {
         /* No available space */
         return NULL;
@@ -756,6 +878,8 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
     e->object->size = nr * MEMORY_PAGESIZE;
     e->object->pages = NULL;
     e->object->refs = 1;
+    e->object->populated = NULL;
+    e->object->lock = 0;
 
     /* Prepare for free spaces */
     f0 = (virt_memory_free_t *)vmem->allocator.alloc(vmem);
@@ -767,16 +891,9 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
         goto error_f1;
     }
 
-    /* Align for superpages */
-    if ( superpage ) {
-        if ( f->start & (MEMORY_SUPERPAGESIZE - 1) ) {
-            /* Not aligned to superpage, then align */
-            e->start = (f->start + (MEMORY_SUPERPAGESIZE - 1))
-                & ~(uintptr_t)(MEMORY_SUPERPAGESIZE - 1);
-        } else {
-            /* Aligned to superpage */
-            e->start = f->start;
-        }
+    /* Align for superpages or as requested */
+    if ( align ) {
+        e->start = (f->start + (align - 1)) & ~(uintptr_t)(align - 1);
     } else {
         e->start = f->start;
     }
@@ -801,7 +918,7 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
         p->next = NULL;
 
         /* Allocate a physical superpage */
-        r = phys_mem_alloc(vmem->mem->phys, p->order, p->zone, p->numadomain);
+        r = _page_alloc(vmem, p, aflags);
         if ( NULL == r ) {
             vmem->allocator.free(vmem, (void *)p);
             goto error_page;
@@ -840,7 +957,7 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
         p->next = NULL;
 
         /* Allocate a physical page */
-        r = phys_mem_alloc(vmem->mem->phys, p->order, p->zone, p->numadomain);
+        r = _page_alloc(vmem, p, aflags);
         if ( NULL == r ) {
             vmem->allocator.free(vmem, (void *)p);
             goto error_page;
@@ -883,6 +1000,7 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
         if ( ret < 0 ) {
             goto error_post;
         }
+        vmem->allocator.free(vmem, (void *)f1);
     } else if ( f->start + f->size == e->start + e->size ) {
         /* The end address is same, then add the rest to the free entry */
         f0->start = f->start;
@@ -894,7 +1012,7 @@ _alloc_pages_block(virt_memory_t *vmem, virt_memory_block_t *block, size_t nr,
         vmem->allocator.free(vmem, (void *)f1);
     } else {
         f0->start = f->start;
-        f0->size = e->start + e->size - f->start;
+        f0->size = e->start - f->start;
         f1->start = e->start + e->size;
         f1->size = f->start + f->size - f1->start;
         ret = _free_add(block, f0);
@@ -959,11 +1077,10 @@ _alloc_virt_pages_wire(virt_memory_t *vmem, virt_memory_block_t *block,
     size = nr * MEMORY_PAGESIZE;
     superpage = 0;
     if ( size >= MEMORY_SUPERPAGESIZE ) {
-        /* Search larger size to make sure to align superpages */
-        size += MEMORY_SUPERPAGESIZE;
+        /* Align the start address to superpages */
         superpage = 1;
     }
-    f = _search_fit_size(block, size);
+    f = _search_fit(block, size, superpage ? MEMORY_SUPERPAGESIZE : 0);
     if ( NULL == f ) {
         /* No available space */
         return NULL;
@@ -984,6 +1101,8 @@ _alloc_virt_pages_wire(virt_memory_t *vmem, virt_memory_block_t *block,
     e->object->size = nr * MEMORY_PAGESIZE;
     e->object->pages = NULL;
     e->object->refs = 1;
+    e->object->populated = NULL;
+    e->object->lock = 0;
 
     /* Prepare for free spaces */
     f0 = (virt_memory_free_t *)vmem->allocator.alloc(vmem);
@@ -1097,6 +1216,7 @@ _alloc_virt_pages_wire(virt_memory_t *vmem, virt_memory_block_t *block,
         if ( ret < 0 ) {
             goto error_post;
         }
+        vmem->allocator.free(vmem, (void *)f1);
     } else if ( f->start + f->size == e->start + e->size ) {
         /* The end address is same, then add the rest to the free entry */
         f0->start = f->start;
@@ -1108,7 +1228,7 @@ _alloc_virt_pages_wire(virt_memory_t *vmem, virt_memory_block_t *block,
         vmem->allocator.free(vmem, (void *)f1);
     } else {
         f0->start = f->start;
-        f0->size = e->start + e->size - f->start;
+        f0->size = e->start - f->start;
         f1->start = e->start + e->size;
         f1->size = f->start + f->size - f1->start;
         ret = _free_add(block, f0);
@@ -1154,20 +1274,23 @@ error_entry:
 }
 
 /*
- * Allocate pages
+ * Allocate pages (flags: MEMORY_ALLOC_*)
  */
 void *
-memory_alloc_pages(memory_t *mem, size_t nr, int zone, int domain)
+memory_alloc_pages(memory_t *mem, size_t nr, int zone, int domain, int flags)
 {
     virt_memory_block_t *block;
     void *ptr;
 
+    spin_lock(&mem->lock);
     block = mem->kmem.blocks;
     ptr = NULL;
     while ( NULL != block && NULL == ptr ) {
-        ptr = _alloc_pages_block(&mem->kmem, block, nr, zone, domain);
+        ptr = _alloc_pages_block(&mem->kmem, block, nr, zone, domain,
+                                 flags);
         block = block->next;
     }
+    spin_unlock(&mem->lock);
 
     return ptr;
 }
@@ -1213,12 +1336,14 @@ _entry_free(virt_memory_t *vmem, virt_memory_block_t *b, virt_memory_entry_t *e)
 {
     virt_memory_free_t free;
     virt_memory_free_t *f;
-    void *r;
+    virt_memory_free_t *l;
+    virt_memory_free_t *r;
     int ret;
 
-    /* Find a neighboring free entry by address */
-    f = _find_neighbor_free_entry(b, e->start, e->start + e->size);
-    if ( NULL == f ) {
+    /* Find the free entries neighboring to the both sides by address */
+    l = _find_free_entry(b, e->start - 1);
+    r = _find_free_entry(b, e->start + e->size);
+    if ( NULL == l && NULL == r ) {
         /* Not found, then convert the data structure to free entry */
         kmemset(&free, 0, sizeof(virt_memory_free_t));
         free.start = e->start;
@@ -1231,33 +1356,38 @@ _entry_free(virt_memory_t *vmem, virt_memory_block_t *b, virt_memory_entry_t *e)
         if ( ret < 0 ) {
             return -1;
         }
-    } else {
-        /* Remove the node first */
-        r = _free_delete(b, f);
-        kassert( r != NULL );
+        return 0;
+    }
 
-        /* Expand the free region */
-        if ( f->start == e->start + e->size ) {
-            f->start = e->start;
-            f->size = f->size + e->size;
-        } else {
-            f->size = f->size + e->size;
+    /* Expand the free region on the left, or on the right otherwise */
+    if ( NULL != l ) {
+        f = _free_delete(b, l);
+        f->size += e->size;
+        if ( NULL != r ) {
+            /* Merge the right one as well */
+            r = _free_delete(b, r);
+            f->size += r->size;
+            vmem->allocator.free(vmem, (void *)r);
         }
-        vmem->allocator.free(vmem, (void *)e);
-
-        /* Rebalance the size-based tree */
-        ret = _free_add(b, f);
-        kassert( ret == 0 );
+    } else {
+        f = _free_delete(b, r);
+        f->start = e->start;
+        f->size += e->size;
     }
+    vmem->allocator.free(vmem, (void *)e);
+
+    /* Add the merged node back */
+    ret = _free_add(b, f);
+    kassert( ret == 0 );
 
     return 0;
 }
 
 /*
- * Free pages
+ * Free pages of the kernel memory locked by the caller
  */
-void
-memory_free_pages(memory_t *mem, void *ptr)
+static void
+_free_pages(memory_t *mem, void *ptr)
 {
     virt_memory_block_t *b;
     uintptr_t addr;
@@ -1298,6 +1428,33 @@ memory_free_pages(memory_t *mem, void *ptr)
     _entry_free(&mem->kmem, b, e);
 }
 
+/*
+ * Free pages
+ */
+void
+memory_free_pages(memory_t *mem, void *ptr)
+{
+    spin_lock(&mem->lock);
+    _free_pages(mem, ptr);
+    spin_unlock(&mem->lock);
+}
+
+/*
+ * Free pages from a shrinker; returns -1 without freeing them if the kernel
+ * memory is in use as the shrinker may be called within the allocation
+ */
+int
+memory_try_free_pages(memory_t *mem, void *ptr)
+{
+    if ( spin_trylock(&mem->lock) < 0 ) {
+        return -1;
+    }
+    _free_pages(mem, ptr);
+    spin_unlock(&mem->lock);
+
+    return 0;
+}
+
 /*
  * Initialize virtual memory
  */
@@ -1333,7 +1490,8 @@ virt_memory_alloc_pages(virt_memory_t *vmem, size_t nr, int zone, int domain)
     block = vmem->blocks;
     ptr = NULL;
     while ( NULL != block && NULL == ptr ) {
-        ptr = _alloc_pages_block(vmem, block, nr, zone, domain);
+        ptr = _alloc_pages_block(vmem, block, nr, zone, domain,
+                                 MEMORY_ALLOC_ZEROED);
         block = block->next;
     }
 
@@ -1405,7 +1563,6 @@ virt_memory_block_add(virt_memory_t *vmem, uintptr_t start, uintptr_t end)
     n->next = NULL;
     n->entries = NULL;
     n->frees.atree = NULL;
-    n->frees.stree = NULL;
 
     /* Add a free entry aligned to the block and the page size */
     fr = (virt_memory_free_t *)vmem->allocator.alloc(vmem);
@@ -1416,14 +1573,8 @@ virt_memory_block_add(virt_memory_t *vmem, uintptr_t start, uintptr_t end)
     fr->start = (start + MEMORY_PAGESIZE - 1)
         & ~(uintptr_t)(MEMORY_PAGESIZE - 1);
     fr->size = ((end + 1) & ~(uintptr_t)(MEMORY_PAGESIZE - 1)) - fr->start;
-    fr->atree.data = fr;
-    fr->atree.left = NULL;
-    fr->atree.right = NULL;
-    fr->stree.data = fr;
-    fr->stree.left = NULL;
-    fr->stree.right = NULL;
-    n->frees.atree = &fr->atree;
-    n->frees.stree = &fr->stree;
+    ret = _free_add(n, fr);
+    kassert( ret == 0 );
 
     /* Prepare the page table */
     ret = vmem->mem->ifs.prepare(vmem->arch, n->start, n->end - n->start + 1);
@@ -1510,6 +1661,8 @@ virt_memory_wire(virt_memory_t *vmem, uintptr_t virtual, size_t nr,
     e->object->size = nr * MEMORY_PAGESIZE;
     e->object->pages = NULL;
     e->object->refs = 1;
+    e->object->populated = NULL;
+    e->object->lock = 0;
 
     /* Prepare for free spaces */
     f0 = (virt_memory_free_t *)vmem->allocator.alloc(vmem);
@@ -1588,7 +1741,7 @@ virt_memory_wire(virt_memory_t *vmem, uintptr_t virtual, size_t nr,
         vmem->allocator.free(vmem, (void *)f1);
     } else {
         f0->start = f->start;
-        f0->size = e->start + e->size - f->start;
+        f0->size = e->start - f->start;
         f1->start = e->start + e->size;
         f1->size = f->start + f->size - f1->start;
         ret = _free_add(b, f0);
@@ -1712,6 +1865,8 @@ virt_memory_alloc_pages_addr(virt_memory_t *vmem, uintptr_t virtual, size_t nr,
     e->object->size = nr * MEMORY_PAGESIZE;
     e->object->pages = NULL;
     e->object->refs = 1;
+    e->object->populated = NULL;
+    e->object->lock = 0;
 
     /* Prepare for free spaces */
     f0 = (virt_memory_free_t *)vmem->allocator.alloc(vmem);
@@ -1741,7 +1896,7 @@ virt_memory_alloc_pages_addr(virt_memory_t *vmem, uintptr_t virtual, size_t nr,
         p->next = NULL;
 
         /* Allocate a physical page */
-        r = phys_mem_alloc(vmem->mem->phys, p->order, p->zone, p->numadomain);
+        r = _page_alloc(vmem, p, MEMORY_ALLOC_ZEROED);
         if ( NULL == r ) {
             vmem->allocator.free(vmem, (void *)p);
             goto error_page;
@@ -1796,7 +1951,7 @@ virt_memory_alloc_pages_addr(virt_memory_t *vmem, uintptr_t virtual, size_t nr,
         vmem->allocator.free(vmem, (void *)f1);
     } else {
         f0->start = f->start;
-        f0->size = e->start + e->size - f->start;
+        f0->size = e->start - f->start;
         f1->start = e->start + e->size;
         f1->size = f->start + f->size - f1->start;
         ret = _free_add(b, f0);
@@ -1840,25 +1995,670 @@ error_entry:
 }
 
 /*
- * Copy object
+ * Release a reference to the object; the object is released with its pages
+ * and the reference to the backing object when no one refers to it
+ */
+static void
+_object_release(virt_memory_t *vmem, virt_memory_object_t *obj)
+{
+    virt_memory_object_t *backing;
+    page_t *p;
+
+    while ( NULL != obj ) {
+        spin_lock(&obj->lock);
+        obj->refs--;
+        if ( obj->refs > 0 ) {
+            spin_unlock(&obj->lock);
+            break;
+        }
+        spin_unlock(&obj->lock);
+        /* No one else refers to the object any longer */
+        while ( NULL != obj->pages ) {
+            p = obj->pages;
+            obj->pages = p->next;
+            if ( !(p->flags & MEMORY_PGF_WIRED) ) {
+                phys_mem_free(vmem->mem->phys, (void *)p->physical, p->order,
+                              p->zone, p->numadomain);
+            }
+            vmem->allocator.free(vmem, (void *)p);
+        }
+        if ( NULL != obj->populated ) {
+            kfree(obj->populated);
+        }
+        backing = _backing_object(obj);
+        vmem->allocator.free(vmem, (void *)obj);
+        obj = backing;
+    }
+}
+
+/*
+ * Find the page including the index from the page list of the object
+ */
+static page_t *
+_find_page(virt_memory_object_t *obj, uintptr_t index)
+{
+    page_t *p;
+
+    for ( p = obj->pages; NULL != p && p->index <= index; p = p->next ) {
+        if ( index < p->index + ((uintptr_t)1 << p->order) ) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the page of the index from the backing objects of the object locked by
+ * the caller; the backing objects are locked hand over hand, and the owner of
+ * the page found is returned locked
+ */
+static page_t *
+_object_page(virt_memory_object_t *obj, uintptr_t index,
+             virt_memory_object_t **owner)
+{
+    virt_memory_object_t *prev;
+    page_t *p;
+
+    prev = NULL;
+    for ( obj = _backing_object(obj); NULL != obj;
+          obj = _backing_object(obj) ) {
+        spin_lock(&obj->lock);
+        if ( NULL != prev ) {
+            spin_unlock(&prev->lock);
+        }
+        p = _find_page(obj, index);
+        if ( NULL != p ) {
+            *owner = obj;
+            return p;
+        }
+        prev = obj;
+    }
+    if ( NULL != prev ) {
+        spin_unlock(&prev->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Check if no page of the object is in the superpage range starting at the
+ * index
+ */
+static int
+_range_pages_empty(virt_memory_object_t *obj, uintptr_t index)
+{
+    page_t *p;
+
+    for ( p = obj->pages; NULL != p && p->index < index
+              + ((uintptr_t)1 << MEMORY_SUPERPAGE_ORDER); p = p->next ) {
+        if ( p->index + ((uintptr_t)1 << p->order) > index ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Check if no page of the object locked by the caller and its backing objects
+ * is in the superpage range starting at the index
  */
 static int
-_copy_object(virt_memory_t *vmem, virt_memory_object_t *dst,
-             virt_memory_object_t *src)
+_range_empty(virt_memory_object_t *obj, uintptr_t index)
 {
-    page_t *dp;
-    page_t *sp;
+    virt_memory_object_t *prev;
+    int ret;
+
+    if ( !_range_pages_empty(obj, index) ) {
+        return 0;
+    }
+    ret = 1;
+    prev = NULL;
+    for ( obj = _backing_object(obj); NULL != obj;
+          obj = _backing_object(obj) ) {
+        spin_lock(&obj->lock);
+        if ( NULL != prev ) {
+            spin_unlock(&prev->lock);
+        }
+        prev = obj;
+        if ( !_range_pages_empty(obj, index) ) {
+            ret = 0;
+            break;
+        }
+    }
+    if ( NULL != prev ) {
+        spin_unlock(&prev->lock);
+    }
 
-    dp = dst->pages;
-    sp = src->pages;
-    while ( NULL != dp && NULL != sp ) {
-        if ( dp->index != sp->index || dp->order != sp->order ) {
+    return ret;
+}
+
+/*
+ * Add the delta to the number of the pages in the superpage range of the object
+ * including the index, and return the updated number.  The counters are
+ * allocated on the first page added; the number is only a hint to try
+ * promotion (e.g., the pages added before the allocation are not counted).
+ */
+static int
+_populate(virt_memory_object_t *obj, uintptr_t index, int delta)
+{
+    size_t nr;
+    uintptr_t i;
+
+    if ( NULL == obj->populated ) {
+        if ( delta <= 0 ) {
+            return 0;
+        }
+        nr = (obj->size + MEMORY_SUPERPAGESIZE - 1) / MEMORY_SUPERPAGESIZE;
+        obj->populated = kmalloc(sizeof(uint16_t) * nr);
+        if ( NULL == obj->populated ) {
+            return 0;
+        }
+        kmemset(obj->populated, 0, sizeof(uint16_t) * nr);
+    }
+    i = index >> MEMORY_SUPERPAGE_ORDER;
+    if ( i * MEMORY_SUPERPAGESIZE >= obj->size ) {
+        return 0;
+    }
+    if ( delta < 0 && obj->populated[i] < -delta ) {
+        obj->populated[i] = 0;
+    } else {
+        obj->populated[i] += delta;
+    }
+
+    return obj->populated[i];
+}
+
+/*
+ * Split the superpage of the object locked by the caller into pages in place
+ * (demotion); the mappings of the superpage are split by the page table on the
+ * next operation on a page
+ */
+static int
+_demote(virt_memory_t *vmem, virt_memory_object_t *obj, page_t *p)
+{
+    page_t *next;
+    page_t *q;
+    uintptr_t i;
+
+    next = p->next;
+    for ( i = ((uintptr_t)1 << p->order) - 1; i > 0; i-- ) {
+        q = (page_t *)vmem->allocator.alloc(vmem);
+        if ( NULL == q ) {
+            while ( p->next != next ) {
+                q = p->next;
+                p->next = q->next;
+                vmem->allocator.free(vmem, (void *)q);
+            }
             return -1;
         }
-        vmem->mem->ifs.copy(vmem->arch, dp->physical, sp->physical,
-                            (1ULL << dp->order) * MEMORY_PAGESIZE);
-        dp = dp->next;
-        sp = sp->next;
+        q->index = p->index + i;
+        q->physical = p->physical + i * MEMORY_PAGESIZE;
+        q->flags = p->flags;
+        q->zone = p->zone;
+        q->order = 0;
+        q->numadomain = p->numadomain;
+        q->next = p->next;
+        p->next = q;
+    }
+    _populate(obj, p->index, 1 << p->order);
+    p->order = 0;
+
+    return 0;
+}
+
+/*
+ * Replace the pages of the object fully populating the superpage range
+ * including the index with a superpage (promotion); the pages are merged if
+ * they are on a physical superpage, or copied otherwise.  Returns the
+ * superpage or NULL if not promoted.  This is tried only when the population
+ * count of the range reaches the number of pages in a superpage.
+ */
+static page_t *
+_promote(virt_memory_t *vmem, virt_memory_entry_t *e, virt_memory_object_t *obj,
+         uintptr_t index)
+{
+    page_t **pp;
+    page_t *p;
+    page_t *q;
+    page_t *np;
+    page_t *next;
+    uintptr_t virtual;
+    uintptr_t i;
+    void *r;
+    int merge;
+    int ret;
+
+    index &= ~(((uintptr_t)1 << MEMORY_SUPERPAGE_ORDER) - 1);
+    pp = &obj->pages;
+    while ( NULL != *pp && (*pp)->index < index ) {
+        pp = &(*pp)->next;
+    }
+
+    if ( NULL == *pp ) {
+        return NULL;
+    }
+
+    /* Check the pages */
+    merge = !((*pp)->physical & (MEMORY_SUPERPAGESIZE - 1));
+    for ( i = 0, p = *pp; i < ((uintptr_t)1 << MEMORY_SUPERPAGE_ORDER);
+          i++, p = p->next ) {
+        if ( NULL == p || p->index != index + i || 0 != p->order
+             || (p->flags & MEMORY_PGF_WIRED) ) {
+            return NULL;
+        }
+        if ( p->physical != (*pp)->physical + i * MEMORY_PAGESIZE
+             || p->zone != (*pp)->zone
+             || p->numadomain != (*pp)->numadomain ) {
+            merge = 0;
+        }
+    }
+    if ( !_in_entry(e, index, MEMORY_SUPERPAGE_ORDER) ) {
+        return NULL;
+    }
+    np = *pp;
+    virtual = e->start + index * MEMORY_PAGESIZE - e->offset;
+
+    if ( !merge ) {
+        /* Copy to a physical superpage */
+        np = (page_t *)vmem->allocator.alloc(vmem);
+        if ( NULL == np ) {
+            return NULL;
+        }
+        kmemcpy(np, *pp, sizeof(page_t));
+        np->zone = MEMORY_ZONE_NUMA_AWARE;
+        np->numadomain = MEMORY_DOMAIN_ANY;
+        np->order = MEMORY_SUPERPAGE_ORDER;
+        r = _page_alloc(vmem, np, 0);
+        if ( NULL == r ) {
+            /* Fragmented */
+            vmem->allocator.free(vmem, (void *)np);
+            return NULL;
+        }
+        np->physical = (uintptr_t)r;
+        for ( i = 0, q = *pp; q != p; i++, q = q->next ) {
+            vmem->mem->ifs.copy(vmem->arch, np->physical
+                                + i * MEMORY_PAGESIZE, q->physical,
+                                MEMORY_PAGESIZE);
+        }
+    }
+
+    /* Replace the mappings; the page table released by the unmaps is not
+       needed to map the superpage */
+    for ( i = 0, q = *pp; q != p; i++, q = q->next ) {
+        ret = vmem->mem->ifs.unmap(vmem->arch, virtual + i * MEMORY_PAGESIZE,
+                                   q);
+        kassert(ret == 0);
+    }
+    np->order = MEMORY_SUPERPAGE_ORDER;
+    np->flags &= ~MEMORY_PGF_COW;
+    ret = vmem->mem->ifs.map(vmem->arch, virtual, np, vmem->flags);
+    kassert(ret == 0);
+
+    /* Release the pages */
+    q = merge ? np->next : *pp;
+    while ( q != p ) {
+        next = q->next;
+        if ( !merge ) {
+            phys_mem_free(vmem->mem->phys, (void *)q->physical, q->order,
+                          q->zone, q->numadomain);
+        }
+        vmem->allocator.free(vmem, (void *)q);
+        q = next;
+    }
+    np->next = p;
+    *pp = np;
+    _populate(obj, index, -(1 << MEMORY_SUPERPAGE_ORDER));
+
+    return np;
+}
+
+/*
+ * Merge the backing objects only referred to by the object locked by the caller
+ * into the object (collapse) not to grow the shadow chain on every fork; the
+ * pages hidden by the object are released, and the others are moved keeping
+ * the read-only mappings
+ */
+static void
+_collapse(virt_memory_t *vmem, virt_memory_object_t *obj)
+{
+    virt_memory_object_t *backing;
+    page_t **pp;
+    page_t *p;
+
+    while ( NULL != (backing = _backing_object(obj)) ) {
+        spin_lock(&backing->lock);
+        if ( 1 != backing->refs ) {
+            spin_unlock(&backing->lock);
+            return;
+        }
+        pp = &obj->pages;
+        while ( NULL != backing->pages ) {
+            p = backing->pages;
+            backing->pages = p->next;
+            while ( NULL != *pp && (*pp)->index
+                    + ((uintptr_t)1 << (*pp)->order) <= p->index ) {
+                pp = &(*pp)->next;
+            }
+            if ( NULL != *pp
+                 && (*pp)->index < p->index + ((uintptr_t)1 << p->order) ) {
+                /* Hidden by the page of the object */
+                if ( !(p->flags & MEMORY_PGF_WIRED) ) {
+                    phys_mem_free(vmem->mem->phys, (void *)p->physical,
+                                  p->order, p->zone, p->numadomain);
+                }
+                vmem->allocator.free(vmem, (void *)p);
+                continue;
+            }
+            p->flags |= MEMORY_PGF_COW;
+            p->next = *pp;
+            *pp = p;
+            pp = &p->next;
+            if ( 0 == p->order ) {
+                _populate(obj, p->index, 1);
+            }
+        }
+        obj->type = backing->type;
+        obj->u = backing->u;
+        spin_unlock(&backing->lock);
+        if ( NULL != backing->populated ) {
+            kfree(backing->populated);
+        }
+        vmem->allocator.free(vmem, (void *)backing);
+    }
+}
+
+/*
+ * Get the page of the entry at the virtual address with MEMORY_FAULT_* flags,
+ * allocating a zeroed page on the first touch.  A page shared copy-on-write is
+ * mapped read-only on a read, and made private to the shadow object of the
+ * entry on a write; the content is copied unless MEMORY_FAULT_OVERWRITE is
+ * specified, and the page is moved instead if no other object refers to the
+ * backing object.  An untouched superpage range in the entry is backed by a
+ * superpage, falling back to pages if no physical superpage is available, and
+ * a range fully populated by pages is promoted.  The returned page may be a
+ * superpage including the virtual address.  The object of the entry is locked
+ * by the caller, and the owner of the shared page found is returned locked.
+ */
+static page_t *
+_fault_page_locked(virt_memory_t *vmem, virt_memory_entry_t *e,
+                   uintptr_t virtual, int flags, virt_memory_object_t **owner)
+{
+    virt_memory_object_t *obj;
+    page_t **pp;
+    page_t *p;
+    page_t *np;
+    uintptr_t index;
+    uintptr_t sindex;
+    void *r;
+    int take;
+    int ret;
+
+    obj = e->object;
+    index = (e->offset + virtual - e->start) / MEMORY_PAGESIZE;
+    sindex = index & ~(((uintptr_t)1 << MEMORY_SUPERPAGE_ORDER) - 1);
+
+    /* Search the insertion point in the object */
+    pp = &obj->pages;
+    while ( NULL != *pp
+            && (*pp)->index + ((uintptr_t)1 << (*pp)->order) <= index ) {
+        pp = &(*pp)->next;
+    }
+    if ( NULL != *pp && (*pp)->index <= index ) {
+        /* Already allocated (and mapped) */
+        p = *pp;
+        if ( (flags & MEMORY_FAULT_WRITE) && (p->flags & MEMORY_PGF_COW) ) {
+            /* Moved from the collapsed backing object; make it writable */
+            ret = vmem->mem->ifs.unmap(vmem->arch, virtual - (index - p->index)
+                                       * MEMORY_PAGESIZE, p);
+            kassert(ret == 0);
+            ret = vmem->mem->ifs.map(vmem->arch, virtual - (index - p->index)
+                                     * MEMORY_PAGESIZE, p, vmem->flags);
+            kassert(ret == 0);
+            p->flags &= ~MEMORY_PGF_COW;
+        }
+        return p;
+    }
+
+    /* Find the page shared with the other processes */
+    p = _object_page(obj, index, owner);
+    if ( NULL != p && p->order > 0 && !_in_entry(e, p->index, p->order) ) {
+        /* Not mappable as a superpage in this entry */
+        if ( _demote(vmem, *owner, p) < 0 ) {
+            return NULL;
+        }
+        p = _find_page(*owner, index);
+    }
+    if ( NULL != p && !(flags & MEMORY_FAULT_WRITE) ) {
+        if ( !vmem->mem->ifs.v2p(vmem->arch, (void *)virtual) ) {
+            ret = vmem->mem->ifs.map(vmem->arch, virtual
+                                     - (index - p->index) * MEMORY_PAGESIZE,
+                                     p, vmem->flags | MEMORY_VMF_COW);
+            if ( ret < 0 ) {
+                return NULL;
+            }
+        }
+        return p;
+    }
+
+    take = (NULL != p && *owner == _backing_object(obj)
+            && 1 == (*owner)->refs);
+    if ( take ) {
+        /* Take over the page from the backing object */
+        np = p;
+        np->flags &= ~MEMORY_PGF_COW;
+    } else {
+        np = (page_t *)vmem->allocator.alloc(vmem);
+        if ( NULL == np ) {
+            return NULL;
+        }
+        np->index = index;
+        np->zone = MEMORY_ZONE_NUMA_AWARE;
+        np->numadomain = MEMORY_DOMAIN_ANY;
+        np->flags = 0;
+        if ( e->flags & MEMORY_VMF_RW ) {
+            np->flags |= MEMORY_PGF_RW;
+        }
+        np->order = 0;
+        r = NULL;
+        if ( NULL != p && p->order > 0 ) {
+            /* Copy the superpage */
+            np->index = p->index;
+            np->order = p->order;
+            r = _page_alloc(vmem, np, 0);
+            if ( NULL != r ) {
+                vmem->mem->ifs.copy(vmem->arch, (uintptr_t)r, p->physical,
+                                    MEMORY_PAGESIZE << p->order);
+            } else if ( _demote(vmem, *owner, p) < 0 ) {
+                vmem->allocator.free(vmem, (void *)np);
+                return NULL;
+            } else {
+                /* Fragmented; copy the page demoted from the superpage */
+                np->index = index;
+                np->order = 0;
+                np->numadomain = MEMORY_DOMAIN_ANY;
+                p = _find_page(*owner, index);
+            }
+        } else if ( NULL == p && _in_entry(e, sindex, MEMORY_SUPERPAGE_ORDER)
+                    && _range_empty(obj, sindex) ) {
+            /* Back the untouched range with a superpage */
+            np->index = sindex;
+            np->order = MEMORY_SUPERPAGE_ORDER;
+            r = _page_alloc(vmem, np, MEMORY_ALLOC_ZEROED);
+            if ( NULL == r ) {
+                /* Fragmented */
+                np->index = index;
+                np->order = 0;
+                np->numadomain = MEMORY_DOMAIN_ANY;
+            }
+        }
+        if ( NULL == r && NULL != p && !(flags & MEMORY_FAULT_OVERWRITE) ) {
+            /* Copy the page */
+            r = _page_alloc(vmem, np, 0);
+            if ( NULL != r ) {
+                vmem->mem->ifs.copy(vmem->arch, (uintptr_t)r, p->physical,
+                                    MEMORY_PAGESIZE);
+            }
+        } else if ( NULL == r ) {
+            r = _page_alloc(vmem, np, MEMORY_ALLOC_ZEROED);
+        }
+        if ( NULL == r ) {
+            vmem->allocator.free(vmem, (void *)np);
+            return NULL;
+        }
+        np->physical = (uintptr_t)r;
+    }
+
+    /* Map the page (replacing the read-only mapping of the shared page) */
+    if ( NULL != p ) {
+        ret = vmem->mem->ifs.unmap(vmem->arch, virtual
+                                   - (index - p->index) * MEMORY_PAGESIZE, p);
+        kassert(ret == 0);
+    }
+    ret = vmem->mem->ifs.map(vmem->arch, virtual
+                             - (index - np->index) * MEMORY_PAGESIZE, np,
+                             vmem->flags);
+    if ( ret < 0 ) {
+        if ( !take ) {
+            phys_mem_free(vmem->mem->phys, (void *)np->physical, np->order,
+                          np->zone, np->numadomain);
+            vmem->allocator.free(vmem, (void *)np);
+        }
+        return NULL;
+    }
+
+    if ( take ) {
+        for ( pp = &(*owner)->pages; *pp != p; pp = &(*pp)->next ) {
+        }
+        *pp = p->next;
+        if ( 0 == p->order ) {
+            _populate(*owner, p->index, -1);
+        }
+        /* Search the insertion point again */
+        for ( pp = &obj->pages; NULL != *pp && (*pp)->index < np->index;
+              pp = &(*pp)->next ) {
+        }
+    }
+    np->next = *pp;
+    *pp = np;
+
+    if ( 0 == np->order && (1 << MEMORY_SUPERPAGE_ORDER)
+         == _populate(obj, np->index, 1) ) {
+        /* The range is fully populated; try to promote it */
+        p = _promote(vmem, e, obj, index);
+        if ( NULL != p ) {
+            np = p;
+        }
+    }
+
+    return np;
+}
+
+/*
+ * Get the page of the entry at the virtual address with MEMORY_FAULT_* flags
+ * under the locks of the objects; see _fault_page_locked()
+ */
+static page_t *
+_fault_page(virt_memory_t *vmem, virt_memory_entry_t *e, uintptr_t virtual,
+            int flags)
+{
+    virt_memory_object_t *owner;
+    page_t *p;
+
+    spin_lock(&e->object->lock);
+    _collapse(vmem, e->object);
+    owner = NULL;
+    p = _fault_page_locked(vmem, e, virtual, flags, &owner);
+    if ( NULL != owner ) {
+        spin_unlock(&owner->lock);
+    }
+    spin_unlock(&e->object->lock);
+
+    return p;
+}
+
+/*
+ * Resolve a page fault at the virtual address with MEMORY_FAULT_* flags;
+ * returns 0 if the faulting access can be restarted
+ */
+int
+virt_memory_fault(virt_memory_t *vmem, uintptr_t virtual, int flags)
+{
+    virt_memory_block_t *b;
+    virt_memory_entry_t *e;
+
+    b = _find_block(vmem, virtual);
+    if ( NULL == b ) {
+        return -1;
+    }
+    e = _find_entry(b, virtual);
+    if ( NULL == e ) {
+        return -1;
+    }
+
+    /* The pages of shared objects are always mapped */
+    if ( e->flags & MEMORY_VMF_SHARED ) {
+        return -1;
+    }
+    if ( (flags & MEMORY_FAULT_WRITE) && !(e->flags & MEMORY_VMF_RW) ) {
+        return -1;
+    }
+
+    virtual &= ~(MEMORY_PAGESIZE - 1);
+    if ( NULL == _fault_page(vmem, e, virtual, flags & MEMORY_FAULT_WRITE) ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write data to the virtual memory through the kernel mapping of the pages
+ * regardless of the protection (e.g., to load a program to the read-only
+ * text); the pages are allocated or made private before written
+ */
+int
+virt_memory_write(virt_memory_t *vmem, uintptr_t virtual, const void *src,
+                  size_t size)
+{
+    virt_memory_block_t *b;
+    virt_memory_entry_t *e;
+    page_t *p;
+    uintptr_t off;
+    size_t len;
+    int flags;
+
+    while ( size > 0 ) {
+        b = _find_block(vmem, virtual);
+        if ( NULL == b ) {
+            return -1;
+        }
+        e = _find_entry(b, virtual);
+        if ( NULL == e ) {
+            return -1;
+        }
+        off = virtual & (MEMORY_PAGESIZE - 1);
+        len = MEMORY_PAGESIZE - off;
+        if ( len > size ) {
+            len = size;
+        }
+
+        flags = MEMORY_FAULT_WRITE;
+        if ( MEMORY_PAGESIZE == len ) {
+            flags |= MEMORY_FAULT_OVERWRITE;
+        }
+        p = _fault_page(vmem, e, virtual - off, flags);
+        if ( NULL == p ) {
+            return -1;
+        }
+        /* Offset in the (super)page */
+        off = e->offset + virtual - e->start - p->index * MEMORY_PAGESIZE;
+        kmemcpy((void *)(p->physical + vmem->mem->phys->p2v + off), src, len);
+
+        virtual += len;
+        src += len;
+        size -= len;
     }
 
     return 0;
@@ -1892,22 +2692,42 @@ _entry_fork(virt_memory_t *dst, virt_memory_t *src, virt_memory_block_t *b,
         }
     }
 
-    if ( NULL != ccp ) {
-        /* Get the forked object */
-        obj = ccp->object;
+    if ( e->flags & MEMORY_VMF_SHARED ) {
+        /* Share the object */
+        obj = e->object;
     } else {
-        if ( i >= nr ) {
-            return -1;
-        }
+        if ( NULL == ccp ) {
+            if ( i >= nr ) {
+                return -1;
+            }
 
-        /* Copy the object (CoW is to be implemented.) */
-        obj = virt_memory_alloc_object(dst, e->object->size);
-        if ( NULL == obj ) {
-            return -1;
+            /* Shadow the object in both of the processes, and add them to the
+               forked cache list */
+            ccl[i].object = _alloc_shadow(dst, e->object);
+            if ( NULL == ccl[i].object ) {
+                return -1;
+            }
+            ccl[i].parent = _alloc_shadow(src, e->object);
+            if ( NULL == ccl[i].parent ) {
+                _object_release(dst, ccl[i].object);
+                return -1;
+            }
+            ccl[i].orig = e->object;
+            ccp = &ccl[i];
         }
-        /* Add to the copied cache list */
-        ccl[i].orig = e->object;
-        ccl[i].object = obj;
+
+        /* Share the pages read-only, and switch the original entry to the
+           shadow object */
+        _protect_pages(src, e);
+        spin_lock(&e->object->lock);
+        e->object->refs--;
+        spin_unlock(&e->object->lock);
+        e->object = ccp->parent;
+        spin_lock(&e->object->lock);
+        e->object->refs++;
+        spin_unlock(&e->object->lock);
+        e->flags |= MEMORY_VMF_COW;
+        obj = ccp->object;
     }
 
     /* Allocate an entry */
@@ -1987,7 +2807,6 @@ _block_fork(virt_memory_t *dst, virt_memory_t *src, virt_memory_block_t *sb)
     virt_memory_block_t *b;
     size_t nr;
     struct virt_memory_fork_cache *ccl;
-    size_t i;
 
     /* Allocate data and initialize the block */
     b = virt_memory_block_add(dst, sb->start, sb->end);
@@ -2013,14 +2832,6 @@ _block_fork(virt_memory_t *dst, virt_memory_t *src, virt_memory_block_t *sb)
         return -1;
     }
 
-    /* Copy object contents */
-    for ( i = 0; i < nr; i++ ) {
-        if ( NULL == ccl[i].orig ) {
-            break;
-        }
-        _copy_object(src, ccl[i].object, ccl[i].orig);
-    }
-
     return 0;
 }
 
@@ -2033,6 +2844,9 @@ virt_memory_fork(virt_memory_t *dst, virt_memory_t *src)
     virt_memory_block_t *b;
     int ret;
 
+    /* Inherit the memory policy */
+    dst->policy = src->policy;
+
     /* Copy blocks */
     b = src->blocks;
     while ( NULL != b ) {
@@ -2058,6 +2872,9 @@ virt_memory_new(virt_memory_t *dst, memory_t *mem, virt_memory_allocator_t *a)
 
     dst->mem = mem;
     dst->blocks = NULL;
+    dst->policy.mode = MEMORY_POLICY_LOCAL;
+    dst->policy.domain = 0;
+    dst->policy.next = 0;
 
     /* Setup allocator */
     dst->allocator.spec = a->spec;
@@ -2084,33 +2901,38 @@ virt_memory_new(virt_memory_t *dst, memory_t *mem, virt_memory_allocator_t *a)
 static void
 _release_entry(virt_memory_t *vmem, virt_memory_entry_t *e)
 {
+    virt_memory_object_t *obj;
+    virt_memory_object_t *prev;
     page_t *p;
-    page_t *tmp;
-    uintptr_t virtual;
+    size_t off;
     int ret;
 
-    /* Unmap pages */
-    p = e->object->pages;
-    virtual = e->start;
-    while ( NULL != p ) {
-        ret = vmem->mem->ifs.unmap(vmem->arch, virtual, p);
-        kassert(ret == 0);
-        virtual += ((uintptr_t)MEMORY_PAGESIZE << p->order);
-        p = p->next;
+    /* Unmap pages (including those of the backing objects; unmapping the
+       pages hidden by the upper objects is no-op) */
+    off = e->offset / MEMORY_PAGESIZE;
+    prev = NULL;
+    for ( obj = e->object; NULL != obj; obj = _backing_object(obj) ) {
+        spin_lock(&obj->lock);
+        if ( NULL != prev ) {
+            spin_unlock(&prev->lock);
+        }
+        prev = obj;
+        for ( p = obj->pages; NULL != p; p = p->next ) {
+            if ( !_in_entry(e, p->index, p->order) ) {
+                continue;
+            }
+            ret = vmem->mem->ifs.unmap(vmem->arch, e->start
+                                       + (p->index - off) * MEMORY_PAGESIZE,
+                                       p);
+            kassert(ret == 0);
+        }
+    }
+    if ( NULL != prev ) {
+        spin_unlock(&prev->lock);
     }
 
     /* Decrement the reference counter */
-    e->object->refs--;
-    if ( 0 == e->object->refs ) {
-        /* Release the object and pages */
-        p = e->object->pages;
-        while ( NULL != p ) {
-            tmp = p;
-            p = p->next;
-            vmem->allocator.free(vmem, (void *)tmp);
-        }
-        vmem->allocator.free(vmem, (void *)e->object);
-    }
+    _object_release(vmem, e->object);
 
     vmem->allocator.free(vmem, (void *)e);
 }
@@ -2139,7 +2961,7 @@ _block_free(virt_memory_t *vmem, virt_memory_block_t *b)
     /* Release free entries */
     while ( NULL != b->frees.atree ) {
         n = b->frees.atree;
-        f = (virt_memory_free_t *)n;
+        f = (virt_memory_free_t *)n->data;
         r = _free_delete(b, f);
         kassert( r == f );
         vmem->allocator.free(vmem, (void *)f);
@@ -33,42 +33,114 @@
 #define MEMORY_ZONE_CORE_NUM            2
 #define MEMORY_ZONE_NUMA_AWARE          2
 
+/* Resolve the domain of the NUMA-aware zone by the memory policy */
+#define MEMORY_DOMAIN_ANY               -1
+
+/* Memory policies (same values as MPOL_* in <sys/advos.h>) */
+#define MEMORY_POLICY_LOCAL             0 /* Local domain first */
+#define MEMORY_POLICY_BIND              1 /* Only the specified domain */
+#define MEMORY_POLICY_INTERLEAVE        2 /* Round-robin over domains */
+#define MEMORY_POLICY_MAX               2
+
 #define MEMORY_ZONE_KERNEL_LB           0x01000000
 #define MEMORY_ZONE_NUMA_AWARE_LB       0x04000000
 
 #define MEMORY_PHYS_BUDDY_ORDER         18
 
+/* Per-CPU page caches: the maximum order cached, and the high watermark and
+   the batch size in pages (divided by the block size at each order) */
+#define MEMORY_PCP_ORDER                3
+#define MEMORY_PCP_HIGH                 64
+#define MEMORY_PCP_BATCH                16
+
+/* Number of pre-zeroed pages kept in each zone (filled by the idle task) */
+#define MEMORY_ZEROED_HIGH              256
+
+/* Maximum number of shrinkers called on memory pressure */
+#define MEMORY_SHRINKER_MAX             4
+
+/* Allocation flags */
+#define MEMORY_ALLOC_ZEROED             (1 << 0)
+#define MEMORY_ALLOC_ALIGNED            (1 << 1) /* Align to the size (2^n) */
+
 #define MEMORY_PAGESIZE_SHIFT           12
 #define MEMORY_PAGESIZE                 (1ULL << MEMORY_PAGESIZE_SHIFT)
 #define MEMORY_SUPERPAGESIZE_SHIFT      21
 #define MEMORY_SUPERPAGESIZE            (1ULL << MEMORY_SUPERPAGESIZE_SHIFT)
+#define MEMORY_SUPERPAGE_ORDER                                          \
+    (MEMORY_SUPERPAGESIZE_SHIFT - MEMORY_PAGESIZE_SHIFT)
 
 /* Page flags */
 #define MEMORY_PGF_WIRED                (1 << 0)
 #define MEMORY_PGF_RW                   (1 << 1)
 #define MEMORY_PGF_EXEC                 (1 << 2)
+#define MEMORY_PGF_COW                  (1 << 3) /* Mapped read-only */
 /* Virtual memory entry flags */
 #define MEMORY_VMF_RW                   (1 << 1)
 #define MEMORY_VMF_EXEC                 (1 << 2)
 #define MEMORY_VMF_GLOBAL               (1 << 6)
 #define MEMORY_VMF_COW                  (1 << 7)
+#define MEMORY_VMF_SHARED               (1 << 8)
 /* Virtual memory flags */
 #define MEMORY_MAP_USER                 (1 << 3)
+/* Page fault flags */
+#define MEMORY_FAULT_WRITE              (1 << 0)
+#define MEMORY_FAULT_OVERWRITE          (1 << 1) /* The whole page written */
 
 #define MEMORY_SLAB_NUM_PAGES           8
+#define MEMORY_SLAB_SIZE                (MEMORY_PAGESIZE * MEMORY_SLAB_NUM_PAGES)
 #define MEMORY_SLAB_CACHE_NAME_MAX      64
 #define MEMORY_SLAB_ALIGNMENT           64 /* Cacheline size (must be 2^n) */
 #define MEMORY_SLAB_CACHE_NAME          "slab_cache"
+#define MEMORY_SLAB_MAGAZINE_NAME       "slab_magazine"
+#define MEMORY_SLAB_MAGAZINE_SIZE       14 /* Rounds (128-byte magazine) */
+#define MEMORY_SLAB_RETAIN              2  /* Unused slabs kept per cache */
+/* Slab cache flags */
+#define MEMORY_SLAB_CACHE_LINE_ALIGN    (1 << 0) /* Objects on cache lines */
 
 /*
  * Page
  */
 struct _phys_memory_buddy_page {
-    /* Linked list's next pointer (virtual address) */
+    /* Doubly linked list's pointers (virtual address) */
     struct _phys_memory_buddy_page *next;
+    struct _phys_memory_buddy_page *prev;
 } __attribute__ ((packed));
 typedef struct _phys_memory_buddy_page phys_memory_buddy_page_t;
 
+/*
+ * Block in a per-CPU page cache
+ */
+typedef struct _phys_memory_pcp_page phys_memory_pcp_page_t;
+struct _phys_memory_pcp_page {
+    phys_memory_pcp_page_t *next;
+    phys_memory_pcp_page_t *prev;
+} __attribute__ ((packed));
+
+/*
+ * Per-CPU page cache of a zone; blocks are allocated from and freed to the
+ * head (hot), and drained to the buddy system from the tail (cold).
+ */
+typedef struct {
+    /* Lock (contended only while draining from another processor) */
+    int lock;
+    /* Number of blocks at each order */
+    int count[MEMORY_PCP_ORDER + 1];
+    /* Lists of blocks at each order */
+    phys_memory_pcp_page_t *head[MEMORY_PCP_ORDER + 1];
+    phys_memory_pcp_page_t *tail[MEMORY_PCP_ORDER + 1];
+} __attribute__ ((aligned(MEMORY_SLAB_ALIGNMENT))) phys_memory_pcp_t;
+
+/*
+ * Pool of pre-zeroed pages of a zone; the link pointer in the first bytes is
+ * cleared when the page is handed out.
+ */
+typedef struct {
+    int lock;
+    int count;
+    phys_memory_buddy_page_t *head;
+} phys_memory_zeroed_t;
+
 /*
  * Physical memory zone
  */
@@ -78,8 +150,33 @@ typedef struct {
 
     /* Head pointers to page blocks at each order of buddy system */
     phys_memory_buddy_page_t *heads[MEMORY_PHYS_BUDDY_ORDER + 1];
+
+    /* Span of the zone (virtual address) */
+    uintptr_t base;
+    uintptr_t end;
+
+    /* Bitmap of the buddy pairs; a bit is set if exactly one of the two
+       buddies is free at the order (NULL while the zone is being built) */
+    uint64_t *bitmap;
+    /* Offset to the bits of each order in the bitmap */
+    uint64_t bitmap_off[MEMORY_PHYS_BUDDY_ORDER];
+
+    /* Per-CPU page caches (indexed by the processor ID) */
+    phys_memory_pcp_t *pcp;
+
+    /* Pre-zeroed pages */
+    phys_memory_zeroed_t zeroed;
 } phys_memory_zone_t;
 
+/*
+ * Shrinker to release cached memory on memory pressure; returns the number of
+ * pages released
+ */
+typedef struct {
+    size_t (*shrink)(void *);
+    void *arg;
+} phys_memory_shrinker_t;
+
 /*
  * Physical memory management
  */
@@ -94,10 +191,34 @@ typedef struct {
     int max_domain;
     phys_memory_zone_t *numazones;
 
-    /* Lock */
+    /* Number of processors (per-CPU data in each zone and cpu_domain) */
+    int nr_cpus;
+
+    /* NUMA topology; the domain of each processor, and the domains ordered by
+       the distance from each domain ((max_domain + 1) entries per domain) */
+    int *cpu_domain;
+    int *fallback;
+
+    /* Shrinkers */
+    int nr_shrinkers;
+    phys_memory_shrinker_t shrinkers[MEMORY_SHRINKER_MAX];
+
+    /* Lock (for the buddy system) */
     int lock;
 } phys_memory_t;
 
+/*
+ * Memory policy
+ */
+typedef struct {
+    /* MEMORY_POLICY_* */
+    int mode;
+    /* Domain to bind */
+    int domain;
+    /* Next domain to interleave */
+    int next;
+} memory_policy_t;
+
 /*
  * System memory map entry
  */
@@ -147,6 +268,12 @@ struct virt_memory_object {
     size_t size;
     /* Reference counter */
     int refs;
+    /* Number of the pages (not superpages) in each superpage range, or NULL
+       if not counted yet */
+    uint16_t *populated;
+    /* Lock for the reference counter and the page list; the objects along a
+       shadow chain are locked from the top */
+    int lock;
     union {
         struct {
             /* Shadow object */
@@ -184,11 +311,11 @@ struct virt_memory_free {
     uintptr_t start;
     /* Size of this space */
     size_t size;
+    /* Maximum size of the spaces in the subtree of atree */
+    size_t max;
 
-    /* Binary tree for start address ordering */
+    /* Binary tree for start address ordering (augmented with max) */
     btree_node_t atree;
-    /* Binary tree for size ordering */
-    btree_node_t stree;
 };
 
 /*
@@ -209,7 +336,6 @@ struct virt_memory_block {
     /* Free space list */
     struct {
         btree_node_t *atree;
-        btree_node_t *stree;
     } frees;
 };
 
@@ -281,6 +407,9 @@ struct virt_memory {
     /* Flags */
     int flags;
 
+    /* Memory policy for the NUMA-aware zone */
+    memory_policy_t policy;
+
     /* Architecture-specific data structure */
     void *arch;
 };
@@ -294,6 +423,8 @@ struct memory {
 
     /* Kernel memory region */
     virt_memory_t kmem;
+    /* Lock for the kernel memory region */
+    int lock;
 
     /* Architecture-specific defintions */
 
@@ -307,12 +438,13 @@ struct memory {
 typedef struct memory_slab_cache memory_slab_cache_t;
 
 /*
- * Slab header
+ * Slab header (at the head of the slab aligned to MEMORY_SLAB_SIZE)
  */
 typedef struct memory_slab_hdr memory_slab_hdr_t;
 struct memory_slab_hdr {
-    /* Pointer to the next slab header */
+    /* Pointers to the next and the previous slab headers in the list */
     memory_slab_hdr_t *next;
+    memory_slab_hdr_t *prev;
     /* Parent cache */
     memory_slab_cache_t *cache;
     /* The number of objects in this slab */
@@ -321,8 +453,10 @@ struct memory_slab_hdr {
     int nused;
     /* Pointer to the first object in this slab */
     void *obj_head;
-    /* Free marks follows (nobjs byte) */
-    uint8_t marks[0];
+    /* Free objects threaded through their first word */
+    void *free;
+    /* Objects from this index on have never been allocated (not in free) */
+    int nfresh;
     /* Objects follow */
 };
 
@@ -335,6 +469,27 @@ typedef struct {
     memory_slab_hdr_t *empty;
 } memory_slab_free_list_t;
 
+/*
+ * Magazine of objects
+ */
+typedef struct memory_slab_magazine memory_slab_magazine_t;
+struct memory_slab_magazine {
+    /* Next magazine in the depot */
+    memory_slab_magazine_t *next;
+    /* Number of objects */
+    int rounds;
+    void *objs[MEMORY_SLAB_MAGAZINE_SIZE];
+};
+
+/*
+ * Per-CPU magazines of a slab cache; the loaded one and the previously loaded
+ * one (each may be NULL).  Only accessed by the owner processor.
+ */
+typedef struct {
+    memory_slab_magazine_t *loaded;
+    memory_slab_magazine_t *prev;
+} __attribute__ ((aligned(MEMORY_SLAB_ALIGNMENT))) memory_slab_cpu_t;
+
 /*
  * Slab cache
  */
@@ -342,9 +497,22 @@ struct memory_slab_cache {
     char name[MEMORY_SLAB_CACHE_NAME_MAX];
     size_t size;
     memory_slab_free_list_t freelist;
+    /* Number of unused slabs (in freelist.full) */
+    int nfull;
+    /* Color of the next slab */
+    int color;
     /* Search tree */
     memory_slab_cache_t *left;
     memory_slab_cache_t *right;
+    /* List of all caches */
+    memory_slab_cache_t *next;
+
+    /* Per-CPU magazines (NULL if the magazine layer is disabled) */
+    memory_slab_cpu_t *cpu;
+    /* Depot of full and empty magazines */
+    int depot_lock;
+    memory_slab_magazine_t *depot_full;
+    memory_slab_magazine_t *depot_empty;
 };
 
 /*
@@ -354,21 +522,38 @@ typedef struct {
     int lock;
     memory_t *mem;
     memory_slab_cache_t *root;
+    memory_slab_cache_t *caches;
+    /* Cache of the magazines */
+    memory_slab_cache_t *magazines;
+    /* Number of processors */
+    int nr_cpus;
 } memory_slab_allocator_t;
 
 /* Defined in physmem.c */
 void
-phys_mem_buddy_add_region(phys_memory_buddy_page_t **, uintptr_t, uintptr_t);
-void * phys_mem_buddy_alloc(phys_memory_buddy_page_t **, int);
-void phys_mem_buddy_free(phys_memory_buddy_page_t **, void *, int);
+phys_mem_buddy_add_region(phys_memory_zone_t *, uintptr_t, uintptr_t);
+void * phys_mem_buddy_alloc(phys_memory_zone_t *, int);
+void phys_mem_buddy_free(phys_memory_zone_t *, void *, int);
+int phys_mem_buddy_track(phys_memory_t *, phys_memory_zone_t *);
 void * phys_mem_alloc(phys_memory_t *, int, int, int);
+void * phys_mem_alloc_zeroed(phys_memory_t *, int, int, int);
 void phys_mem_free(phys_memory_t *, void *, int, int, int);
 int phys_memory_init(phys_memory_t *, int, memory_sysmap_entry_t *, uint64_t);
+int phys_mem_pcp_init(phys_memory_t *, int);
+void phys_mem_pcp_drain(phys_memory_t *);
+int phys_mem_numa_init(phys_memory_t *, const int *, int, const uint8_t *,
+                       int);
+void *
+phys_mem_alloc_policy(phys_memory_t *, int, memory_policy_t *, int, int *);
+int phys_mem_zeroed_fill(phys_memory_t *);
+int phys_mem_register_shrinker(phys_memory_t *, size_t (*)(void *), void *);
 
 /* Defined in kmem.c */
 int kmem_init(virt_memory_t *, phys_memory_t *, uintptr_t);
 int kmem_slab_init(void);
-int kmem_slab_create_cache(const char *, size_t);
+memory_slab_cache_t * kmem_slab_create_cache(const char *, size_t, int);
+void * kmem_slab_cache_alloc(memory_slab_cache_t *);
+int kmem_slab_cache_free(memory_slab_cache_t *, void *);
 void * kmem_slab_alloc(const char *);
 int kmem_slab_free(const char *, void *);
 
@@ -376,8 +561,9 @@ int kmem_slab_free(const char *, void *);
 int
 memory_init(memory_t *, phys_memory_t *, void *, uintptr_t,
             memory_arch_interfaces_t *);
-void * memory_alloc_pages(memory_t *, size_t, int, int);
+void * memory_alloc_pages(memory_t *, size_t, int, int, int);
 void memory_free_pages(memory_t *, void *);
+int memory_try_free_pages(memory_t *, void *);
 
 virt_memory_block_t *
 virt_memory_block_add(virt_memory_t *, uintptr_t, uintptr_t);
@@ -390,8 +576,12 @@ void * virt_memory_wire2(virt_memory_t *, uintptr_t, size_t);
 
 int virt_memory_new(virt_memory_t *, memory_t *, virt_memory_allocator_t *);
 int virt_memory_fork(virt_memory_t *, virt_memory_t *);
+int virt_memory_fault(virt_memory_t *, uintptr_t, int);
+int virt_memory_write(virt_memory_t *, uintptr_t, const void *, size_t);
 
 virt_memory_object_t * virt_memory_alloc_object(virt_memory_t *, size_t);
+virt_memory_object_t *
+virt_memory_alloc_shared_object(virt_memory_t *, uintptr_t, size_t, int);
 virt_memory_entry_t *
 virt_memory_alloc_entry(virt_memory_t *, virt_memory_object_t *, uintptr_t,
                         size_t, off_t, int);
@@ -403,9 +593,17 @@ void kfree(void *);
 
 /* Defined in slab.c */
 int memory_slab_init(memory_slab_allocator_t *, memory_t *);
+void *
+memory_slab_cache_alloc(memory_slab_allocator_t *, memory_slab_cache_t *);
+int
+memory_slab_cache_free(memory_slab_allocator_t *, memory_slab_cache_t *,
+                       void *);
+memory_slab_cache_t * memory_slab_object_cache(void *);
 void * memory_slab_alloc(memory_slab_allocator_t *, const char *);
 int memory_slab_free(memory_slab_allocator_t *, const char *, void *);
-int memory_slab_create_cache(memory_slab_allocator_t *, const char *, size_t);
+memory_slab_cache_t *
+memory_slab_create_cache(memory_slab_allocator_t *, const char *, size_t,
+                         int);
 
 #endif
 
@@ -24,51 +24,107 @@
 #include "memory.h"
 #include "kernel.h"
 
+/* Blocks at each order are paired with their buddies up to this alignment */
+#define BUDDY_SPAN_ALIGN    (MEMORY_PAGESIZE << (MEMORY_PHYS_BUDDY_ORDER + 1))
+
 /*
  * Prototype declarations
  */
-static void _add_block(phys_memory_buddy_page_t **, int, uintptr_t);
 static void
-_add_region_order(phys_memory_buddy_page_t **, int, uintptr_t, uintptr_t);
-static void _split_buddy(phys_memory_buddy_page_t **, int);
-static void _merge_buddy(phys_memory_buddy_page_t **, int);
-static void _insert_buddy(phys_memory_buddy_page_t **, uintptr_t, int);
+_add_region_order(phys_memory_zone_t *, int, uintptr_t, uintptr_t);
+static void _free_block(phys_memory_zone_t *, uintptr_t, int);
+
+/*
+ * Link a block to the free list at the specified order
+ */
+static __inline__ void
+_list_add(phys_memory_zone_t *z, int order, phys_memory_buddy_page_t *block)
+{
+    block->prev = NULL;
+    block->next = z->heads[order];
+    if ( NULL != block->next ) {
+        block->next->prev = block;
+    }
+    z->heads[order] = block;
+}
+
+/*
+ * Unlink a block from the free list at the specified order
+ */
+static __inline__ void
+_list_del(phys_memory_zone_t *z, int order, phys_memory_buddy_page_t *block)
+{
+    if ( NULL != block->prev ) {
+        block->prev->next = block->next;
+    } else {
+        z->heads[order] = block->next;
+    }
+    if ( NULL != block->next ) {
+        block->next->prev = block->prev;
+    }
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+/*
+ * Toggle the bit of the buddy pair containing the block at the specified order,
+ * and return the new value; 1 if exactly one of the pair is free.  Return -1
+ * if the buddies are not tracked.
+ */
+static __inline__ int
+_toggle_pair(phys_memory_zone_t *z, int order, uintptr_t addr)
+{
+    uint64_t idx;
+
+    if ( NULL == z->bitmap || order >= MEMORY_PHYS_BUDDY_ORDER ) {
+        return -1;
+    }
+    idx = z->bitmap_off[order]
+        + ((addr - z->base) >> (MEMORY_PAGESIZE_SHIFT + order + 1));
+    z->bitmap[idx >> 6] ^= (1ULL << (idx & 63));
+
+    return (z->bitmap[idx >> 6] >> (idx & 63)) & 1;
+}
 
 /*
  * Add a block to the specified order
  */
 static void
-_add_block(phys_memory_buddy_page_t **buddy, int order, uintptr_t addr)
+_add_block(phys_memory_zone_t *z, int order, uintptr_t addr)
 {
-    phys_memory_buddy_page_t *page;
-    phys_memory_buddy_page_t **cur;
-
-    page = (phys_memory_buddy_page_t *)addr;
-    page->next = NULL;
-
-    /* Keep the linked list sorted */
-    cur = &buddy[order];
-    while ( *cur ) {
-        if ( addr < (uintptr_t)(*cur) ) {
-            /* Insert here */
-            page->next = *cur;
-            *cur = page;
-            return;
+    uintptr_t next;
+
+    if ( NULL != z->bitmap ) {
+        /* Tracked; this may merge the block with its buddy */
+        if ( addr >= z->base && addr < z->end ) {
+            _free_block(z, addr, order);
         }
+        return;
+    }
 
-        cur = &(*cur)->next;
+    /* Extend the span of the zone */
+    next = addr + (MEMORY_PAGESIZE << order);
+    if ( z->base == z->end ) {
+        z->base = addr;
+        z->end = next;
+    } else {
+        if ( addr < z->base ) {
+            z->base = addr;
+        }
+        if ( next > z->end ) {
+            z->end = next;
+        }
     }
 
-    /* If reaches at the end of the list */
-    *cur = page;
+    _list_add(z, order, (phys_memory_buddy_page_t *)addr);
 }
 
 /*
  * Try to add a memory region to the buddy system at the specified order
  */
 static void
-_add_region_order(phys_memory_buddy_page_t **buddy, int order,
-                  uintptr_t base, uintptr_t next)
+_add_region_order(phys_memory_zone_t *z, int order, uintptr_t base,
+                  uintptr_t next)
 {
     uint64_t blocksize;
     uintptr_t base_aligned;
@@ -92,17 +148,17 @@ _add_region_order(phys_memory_buddy_page_t **buddy, int order,
     /* Add smaller chunk to the lower order of the buddy system */
     if ( base != base_aligned ) {
         ptr = base_aligned < next ? base_aligned : next;
-        _add_region_order(buddy, order - 1, base, ptr);
+        _add_region_order(z, order - 1, base, ptr);
     }
     if ( next != next_aligned && next_aligned >= base ) {
         ptr = next_aligned > base ? next_aligned : base;
-        _add_region_order(buddy, order - 1, ptr, next);
+        _add_region_order(z, order - 1, ptr, next);
     }
 
     /* Add pages to this zone */
     nr = ((next_aligned - base_aligned) >> order) / MEMORY_PAGESIZE;
     for ( i = 0; i < nr; i++ ) {
-        _add_block(buddy, order, base_aligned + i * blocksize);
+        _add_block(z, order, base_aligned + i * blocksize);
     }
 }
 
@@ -110,197 +166,756 @@ _add_region_order(phys_memory_buddy_page_t **buddy, int order,
  * Add a memory region to the buddy system
  */
 void
-phys_mem_buddy_add_region(phys_memory_buddy_page_t **buddy, uintptr_t base,
+phys_mem_buddy_add_region(phys_memory_zone_t *z, uintptr_t base,
                           uintptr_t next)
 {
-    _add_region_order(buddy, MEMORY_PHYS_BUDDY_ORDER, base, next);
+    _add_region_order(z, MEMORY_PHYS_BUDDY_ORDER, base, next);
 }
 
 /*
- * Split a block at the specified order into two
+ * Allocate pages
  */
-static void
-_split_buddy(phys_memory_buddy_page_t **buddy, int order)
+void *
+phys_mem_buddy_alloc(phys_memory_zone_t *z, int order)
 {
     phys_memory_buddy_page_t *block;
-    phys_memory_buddy_page_t *split;
-    uintptr_t offset;
+    int o;
 
-    if ( order >= MEMORY_PHYS_BUDDY_ORDER ) {
-        return;
+    /* Exceed the supported order */
+    if ( order > MEMORY_PHYS_BUDDY_ORDER ) {
+        return NULL;
     }
 
-    if ( NULL != buddy[order] ) {
-        /* Valid block in this order */
-        return;
+    /* Find the smallest order having a free block */
+    for ( o = order; o <= MEMORY_PHYS_BUDDY_ORDER; o++ ) {
+        if ( NULL != z->heads[o] ) {
+            break;
+        }
+    }
+    if ( o > MEMORY_PHYS_BUDDY_ORDER ) {
+        /* No block found */
+        return NULL;
     }
+    block = z->heads[o];
+    _list_del(z, o, block);
+    _toggle_pair(z, o, (uintptr_t)block);
+
+    /* Split the block down to the requested order and free the upper
+       halves */
+    while ( o > order ) {
+        o--;
+        _list_add(z, o, (phys_memory_buddy_page_t *)((uintptr_t)block
+                                                     + (MEMORY_PAGESIZE << o)));
+        _toggle_pair(z, o, (uintptr_t)block);
+    }
+
+    return block;
+}
 
-    /* Split the upper order if no block at the upper order */
-    _split_buddy(buddy, order + 1);
+/*
+ * Free a block and merge it with its buddies as far as possible
+ */
+static void
+_free_block(phys_memory_zone_t *z, uintptr_t addr, int order)
+{
+    uintptr_t buddy;
+
+    while ( order < MEMORY_PHYS_BUDDY_ORDER ) {
+        if ( 0 != _toggle_pair(z, order, addr) ) {
+            /* The buddy is in use (or not tracked) */
+            break;
+        }
+        /* The buddy is also free; merge them */
+        buddy = z->base + ((addr - z->base) ^ (MEMORY_PAGESIZE << order));
+        _list_del(z, order, (phys_memory_buddy_page_t *)buddy);
+        if ( buddy < addr ) {
+            addr = buddy;
+        }
+        order++;
+    }
+    _list_add(z, order, (phys_memory_buddy_page_t *)addr);
+}
 
-    /* Check the upper order */
-    if ( NULL == buddy[order + 1] ) {
-        /* No valid block */
+/*
+ * Release pages
+ */
+void
+phys_mem_buddy_free(phys_memory_zone_t *z, void *ptr, int order)
+{
+    if ( order > MEMORY_PHYS_BUDDY_ORDER ) {
         return;
     }
+    _free_block(z, (uintptr_t)ptr, order);
+}
 
-    /* Take one block from the upper order */
-    block = buddy[order + 1];
-    buddy[order + 1] = buddy[order + 1]->next;
-    block->next = NULL;
+/*
+ * Start tracking the buddies of a zone once its regions have been added; the
+ * bitmap is taken from the kernel zone.
+ */
+int
+phys_mem_buddy_track(phys_memory_t *mem, phys_memory_zone_t *z)
+{
+    phys_memory_buddy_page_t *lists[MEMORY_PHYS_BUDDY_ORDER + 1];
+    phys_memory_buddy_page_t *block;
+    void *bitmap;
+    uint64_t nbits;
+    size_t sz;
+    int order;
+    int i;
 
-    /* Split the block into two */
-    offset = MEMORY_PAGESIZE << order;
-    split = (phys_memory_buddy_page_t *)((uintptr_t)block + offset);
-    split->next = NULL;
-    block->next = split;
-    buddy[order] = block;
+    if ( z->base == z->end ) {
+        /* Empty zone */
+        return 0;
+    }
+
+    /* Align the span so that every buddy pair is within it */
+    z->base &= ~(BUDDY_SPAN_ALIGN - 1);
+    z->end = (z->end + BUDDY_SPAN_ALIGN - 1) & ~(BUDDY_SPAN_ALIGN - 1);
+
+    /* One bit per buddy pair at each order */
+    nbits = 0;
+    for ( i = 0; i < MEMORY_PHYS_BUDDY_ORDER; i++ ) {
+        z->bitmap_off[i] = nbits;
+        nbits += (z->end - z->base) >> (MEMORY_PAGESIZE_SHIFT + i + 1);
+    }
+    sz = ((nbits + 63) >> 6) * sizeof(uint64_t);
+    sz = (sz - 1) >> MEMORY_PAGESIZE_SHIFT;
+    order = 0;
+    while ( sz ) {
+        sz >>= 1;
+        order++;
+    }
+    bitmap = phys_mem_buddy_alloc(&mem->czones[MEMORY_ZONE_KERNEL], order);
+    if ( NULL == bitmap ) {
+        return -1;
+    }
+    kmemset(bitmap, 0, MEMORY_PAGESIZE << order);
+
+    /* Detach all the free blocks, then free them again with the tracking,
+       which merges adjacent buddies as well */
+    for ( i = 0; i <= MEMORY_PHYS_BUDDY_ORDER; i++ ) {
+        lists[i] = z->heads[i];
+        z->heads[i] = NULL;
+    }
+    z->bitmap = bitmap;
+    for ( i = 0; i <= MEMORY_PHYS_BUDDY_ORDER; i++ ) {
+        while ( NULL != lists[i] ) {
+            block = lists[i];
+            lists[i] = block->next;
+            _free_block(z, (uintptr_t)block, i);
+        }
+    }
+
+    return 0;
 }
 
 /*
- * Allocate pages
+ * Resolve the zone
  */
-void *
-phys_mem_buddy_alloc(phys_memory_buddy_page_t **buddy, int order)
+static phys_memory_zone_t *
+_get_zone(phys_memory_t *mem, int zone, int domain)
 {
-    phys_memory_buddy_page_t *block;
+    if ( MEMORY_ZONE_DMA == zone || MEMORY_ZONE_KERNEL == zone ) {
+        return &mem->czones[zone];
+    } else if ( MEMORY_ZONE_NUMA_AWARE == zone ) {
+        if ( NULL != mem->numazones && domain >= 0
+             && domain <= mem->max_domain ) {
+            return &mem->numazones[domain];
+        }
+    }
 
-    /* Exceed the supported order */
-    if ( order > MEMORY_PHYS_BUDDY_ORDER ) {
+    return NULL;
+}
+
+/*
+ * Get the per-CPU page cache of this processor for the zone
+ */
+static phys_memory_pcp_t *
+_get_pcp(phys_memory_t *mem, phys_memory_zone_t *z, int order)
+{
+    int id;
+
+    if ( NULL == z->pcp || order > MEMORY_PCP_ORDER ) {
+        return NULL;
+    }
+    id = this_cpu_id();
+    if ( id < 0 || id >= mem->nr_cpus ) {
         return NULL;
     }
 
-    /* Try to split the upper order if needed */
-    _split_buddy(buddy, order);
-    if ( NULL == buddy[order] ) {
-        /* No block found */
-        return 0;
+    return &z->pcp[id];
+}
+
+/*
+ * Push a block to the head (hot) of the per-CPU list
+ */
+static void
+_pcp_push(phys_memory_pcp_t *pcp, int order, void *ptr)
+{
+    phys_memory_pcp_page_t *page;
+
+    page = ptr;
+    page->prev = NULL;
+    page->next = pcp->head[order];
+    if ( NULL != page->next ) {
+        page->next->prev = page;
+    } else {
+        pcp->tail[order] = page;
     }
-    block = buddy[order];
-    buddy[order] = buddy[order]->next;
-    block->next = NULL;
+    pcp->head[order] = page;
+    pcp->count[order]++;
+}
 
-    return block;
+/*
+ * Pop a block from the head (hot) of the per-CPU list
+ */
+static void *
+_pcp_pop(phys_memory_pcp_t *pcp, int order)
+{
+    phys_memory_pcp_page_t *page;
+
+    page = pcp->head[order];
+    if ( NULL == page ) {
+        return NULL;
+    }
+    pcp->head[order] = page->next;
+    if ( NULL != page->next ) {
+        page->next->prev = NULL;
+    } else {
+        pcp->tail[order] = NULL;
+    }
+    pcp->count[order]--;
+
+    return page;
 }
-void *
-phys_mem_alloc(phys_memory_t *mem, int order, int zone, int domain)
+
+/*
+ * Pop a block from the tail (cold) of the per-CPU list
+ */
+static void *
+_pcp_pop_tail(phys_memory_pcp_t *pcp, int order)
+{
+    phys_memory_pcp_page_t *page;
+
+    page = pcp->tail[order];
+    if ( NULL == page ) {
+        return NULL;
+    }
+    pcp->tail[order] = page->prev;
+    if ( NULL != page->prev ) {
+        page->prev->next = NULL;
+    } else {
+        pcp->head[order] = NULL;
+    }
+    pcp->count[order]--;
+
+    return page;
+}
+
+/*
+ * Return up to nr cold blocks from the per-CPU list to the buddy system
+ */
+static void
+_pcp_drain(phys_memory_t *mem, phys_memory_zone_t *z, phys_memory_pcp_t *pcp,
+           int order, int nr)
 {
     void *ptr;
 
     spin_lock(&mem->lock);
+    while ( nr-- > 0 ) {
+        ptr = _pcp_pop_tail(pcp, order);
+        if ( NULL == ptr ) {
+            break;
+        }
+        phys_mem_buddy_free(z, ptr, order);
+    }
+    spin_unlock(&mem->lock);
+}
 
-    ptr = NULL;
-    if ( MEMORY_ZONE_DMA == zone || MEMORY_ZONE_KERNEL == zone ) {
-        ptr = phys_mem_buddy_alloc(mem->czones[zone].heads, order);
-    } else if ( MEMORY_ZONE_NUMA_AWARE == zone ) {
-        if ( domain <= mem->max_domain ) {
-            ptr = phys_mem_buddy_alloc(mem->numazones[domain].heads, order);
+/*
+ * Allocate a block from the zone (virtual address)
+ */
+static void *
+_zone_alloc(phys_memory_t *mem, phys_memory_zone_t *z, int order)
+{
+    phys_memory_pcp_t *pcp;
+    void *ptr;
+    int i;
+
+    pcp = _get_pcp(mem, z, order);
+    if ( NULL == pcp ) {
+        spin_lock(&mem->lock);
+        ptr = phys_mem_buddy_alloc(z, order);
+        spin_unlock(&mem->lock);
+        return ptr;
+    }
+
+    spin_lock(&pcp->lock);
+    if ( 0 == pcp->count[order] ) {
+        /* Refill a batch from the buddy system */
+        spin_lock(&mem->lock);
+        for ( i = 0; i < (MEMORY_PCP_BATCH >> order); i++ ) {
+            ptr = phys_mem_buddy_alloc(z, order);
+            if ( NULL == ptr ) {
+                break;
+            }
+            _pcp_push(pcp, order, ptr);
+        }
+        spin_unlock(&mem->lock);
+    }
+    ptr = _pcp_pop(pcp, order);
+    spin_unlock(&pcp->lock);
+
+    return ptr;
+}
+
+/*
+ * Call all the shrinkers, and return the number of pages released
+ */
+static size_t
+_shrink(phys_memory_t *mem)
+{
+    size_t n;
+    int i;
+
+    n = 0;
+    for ( i = 0; i < mem->nr_shrinkers; i++ ) {
+        n += mem->shrinkers[i].shrink(mem->shrinkers[i].arg);
+    }
+
+    return n;
+}
+
+/*
+ * Register a shrinker called before an allocation fails; it must not block on
+ * locks held around allocations
+ */
+int
+phys_mem_register_shrinker(phys_memory_t *mem, size_t (*shrink)(void *),
+                           void *arg)
+{
+    int ret;
+
+    spin_lock(&mem->lock);
+    if ( mem->nr_shrinkers >= MEMORY_SHRINKER_MAX ) {
+        ret = -1;
+    } else {
+        mem->shrinkers[mem->nr_shrinkers].shrink = shrink;
+        mem->shrinkers[mem->nr_shrinkers].arg = arg;
+        mem->nr_shrinkers++;
+        ret = 0;
+    }
+    spin_unlock(&mem->lock);
+
+    return ret;
+}
+
+/*
+ * Take a page from the pre-zeroed pool of the zone
+ */
+static void *
+_zeroed_pop(phys_memory_zone_t *z)
+{
+    phys_memory_buddy_page_t *page;
+
+    if ( NULL == z->zeroed.head ) {
+        return NULL;
+    }
+    spin_lock(&z->zeroed.lock);
+    page = z->zeroed.head;
+    if ( NULL != page ) {
+        z->zeroed.head = page->next;
+        z->zeroed.count--;
+        page->next = NULL;
+    }
+    spin_unlock(&z->zeroed.lock);
+
+    return page;
+}
+
+/*
+ * Allocate pages with MEMORY_ALLOC_* flags
+ */
+static void *
+_alloc(phys_memory_t *mem, int order, int zone, int domain, int flags)
+{
+    phys_memory_zone_t *z;
+    void *ptr;
+
+    z = _get_zone(mem, zone, domain);
+    if ( NULL == z ) {
+        return NULL;
+    }
+
+    if ( (flags & MEMORY_ALLOC_ZEROED) && 0 == order ) {
+        ptr = _zeroed_pop(z);
+        if ( NULL != ptr ) {
+            return ptr - mem->p2v;
         }
     }
 
+    ptr = _zone_alloc(mem, z, order);
+    if ( NULL == ptr ) {
+        /* Blocks may be held in the caches of the shrinkers, the per-CPU page
+           caches, and the pre-zeroed pools; release them and retry */
+        _shrink(mem);
+        phys_mem_pcp_drain(mem);
+        ptr = _zone_alloc(mem, z, order);
+    }
+    if ( NULL == ptr ) {
+        return NULL;
+    }
+    if ( flags & MEMORY_ALLOC_ZEROED ) {
+        /* Not in the pool; clear synchronously */
+        kmemset(ptr, 0, MEMORY_PAGESIZE << order);
+    }
+
     /* Virtual to physical */
-    if ( NULL != ptr ) {
-        ptr = ptr - mem->p2v;
+    return ptr - mem->p2v;
+}
+
+/*
+ * Allocate pages
+ */
+void *
+phys_mem_alloc(phys_memory_t *mem, int order, int zone, int domain)
+{
+    return _alloc(mem, order, zone, domain, 0);
+}
+
+/*
+ * Allocate zero-filled pages; order-0 pages are taken from the pre-zeroed pool
+ * if available
+ */
+void *
+phys_mem_alloc_zeroed(phys_memory_t *mem, int order, int zone, int domain)
+{
+    return _alloc(mem, order, zone, domain, MEMORY_ALLOC_ZEROED);
+}
+
+/*
+ * Distance between two domains; the ACPI defaults if not given
+ */
+static int
+_distance(const uint8_t *distance, int ndist, int a, int b)
+{
+    if ( NULL != distance && a < ndist && b < ndist ) {
+        return distance[a * ndist + b];
     }
 
+    return a == b ? 10 : 20;
+}
+
+/*
+ * Set up the NUMA topology for the memory policies: the domain of each of nr
+ * processors, and the ndist x ndist distance matrix (SLIT; may be NULL)
+ */
+int
+phys_mem_numa_init(phys_memory_t *mem, const int *cpu_domain, int nr,
+                   const uint8_t *distance, int ndist)
+{
+    int nd;
+    size_t sz;
+    int order;
+    int *buf;
+    int *list;
+    int i;
+    int j;
+    int k;
+    int d;
+
+    nd = mem->max_domain + 1;
+    sz = sizeof(int) * (nr + nd * nd);
+    sz = (sz - 1) >> MEMORY_PAGESIZE_SHIFT;
+    order = 0;
+    while ( sz ) {
+        sz >>= 1;
+        order++;
+    }
+    spin_lock(&mem->lock);
+    buf = phys_mem_buddy_alloc(&mem->czones[MEMORY_ZONE_KERNEL], order);
     spin_unlock(&mem->lock);
+    if ( NULL == buf ) {
+        return -1;
+    }
 
-    return ptr;
+    /* Domain of each processor */
+    for ( i = 0; i < nr; i++ ) {
+        buf[i] = (cpu_domain[i] >= 0 && cpu_domain[i] < nd)
+            ? cpu_domain[i] : 0;
+    }
+
+    /* Sort the domains by the distance from each domain (insertion sort) */
+    for ( i = 0; i < nd; i++ ) {
+        list = buf + nr + i * nd;
+        for ( j = 0; j < nd; j++ ) {
+            d = _distance(distance, ndist, i, j);
+            for ( k = j; k > 0
+                      && _distance(distance, ndist, i, list[k - 1]) > d;
+                  k-- ) {
+                list[k] = list[k - 1];
+            }
+            list[k] = j;
+        }
+    }
+
+    mem->fallback = buf + nr;
+    mem->cpu_domain = buf;
+    mem->nr_cpus = nr;
+
+    return 0;
 }
 
 /*
- * Merge buddy blocks to the upper order
+ * Allocate pages from the NUMA-aware zone following the memory policy, and
+ * return the domain used in *domain
  */
-static void
-_merge_buddy(phys_memory_buddy_page_t **buddy, int order)
+void *
+phys_mem_alloc_policy(phys_memory_t *mem, int order, memory_policy_t *policy,
+                      int flags, int *domain)
 {
-    phys_memory_buddy_page_t **cur;
-    uintptr_t block;
-    uintptr_t blocksize;
+    int nd;
+    int home;
+    int id;
+    int i;
+    int d;
+    void *ptr;
+
+    nd = mem->max_domain + 1;
+
+    if ( NULL != policy && MEMORY_POLICY_BIND == policy->mode ) {
+        /* Never fall back */
+        *domain = policy->domain;
+        return _alloc(mem, order, MEMORY_ZONE_NUMA_AWARE, policy->domain,
+                      flags);
+    }
+
+    /* Resolve the home domain */
+    if ( NULL != policy && MEMORY_POLICY_INTERLEAVE == policy->mode ) {
+        home = policy->next % nd;
+        policy->next = home + 1;
+    } else {
+        home = 0;
+        id = this_cpu_id();
+        if ( NULL != mem->cpu_domain && id >= 0 && id < mem->nr_cpus ) {
+            home = mem->cpu_domain[id];
+        }
+    }
+    if ( NULL == mem->fallback ) {
+        *domain = home;
+        return _alloc(mem, order, MEMORY_ZONE_NUMA_AWARE, home, flags);
+    }
+
+    /* Try the home domain first, then the others in the distance order */
+    for ( i = 0; i < nd; i++ ) {
+        d = mem->fallback[home * nd + i];
+        ptr = _alloc(mem, order, MEMORY_ZONE_NUMA_AWARE, d, flags);
+        if ( NULL != ptr ) {
+            *domain = d;
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
 
-    if ( order >= MEMORY_PHYS_BUDDY_ORDER ) {
+/*
+ * Release pages
+ */
+void
+phys_mem_free(phys_memory_t *mem, void *ptr, int order, int zone, int domain)
+{
+    phys_memory_zone_t *z;
+    phys_memory_pcp_t *pcp;
+
+    z = _get_zone(mem, zone, domain);
+    if ( NULL == z || NULL == ptr ) {
+        return;
+    }
+
+    /* Physical to virtual */
+    ptr = ptr + mem->p2v;
+
+    pcp = _get_pcp(mem, z, order);
+    if ( NULL == pcp ) {
+        spin_lock(&mem->lock);
+        phys_mem_buddy_free(z, ptr, order);
+        spin_unlock(&mem->lock);
         return;
     }
 
-    blocksize = MEMORY_PAGESIZE << order;
-
-    cur = &buddy[order];
-    while ( *cur ) {
-        block = (uintptr_t)*cur;
-        if ( 0 == (block & ((blocksize << 1) - 1)) ) {
-            /* is aligned for the upper order */
-            if ( (uintptr_t)(*cur)->next == block + blocksize ) {
-                /* is buddy */
-                *cur = (*cur)->next->next;
-                _insert_buddy(buddy, block, order + 1);
-                /* May return here if we can ensure only one block could be
-                   merged. */
-                if ( NULL == *cur ) {
-                    break;
-                }
+    spin_lock(&pcp->lock);
+    _pcp_push(pcp, order, ptr);
+    if ( pcp->count[order] > (MEMORY_PCP_HIGH >> order) ) {
+        /* Exceed the high watermark; drain a batch of cold blocks */
+        _pcp_drain(mem, z, pcp, order, MEMORY_PCP_BATCH >> order);
+    }
+    spin_unlock(&pcp->lock);
+}
+
+/*
+ * Prepare the per-CPU page caches of a zone
+ */
+static int
+_pcp_zone_init(phys_memory_t *mem, phys_memory_zone_t *z, int nr)
+{
+    size_t sz;
+    int order;
+
+    sz = sizeof(phys_memory_pcp_t) * nr;
+    sz = (sz - 1) >> MEMORY_PAGESIZE_SHIFT;
+    order = 0;
+    while ( sz ) {
+        sz >>= 1;
+        order++;
+    }
+    z->pcp = phys_mem_buddy_alloc(&mem->czones[MEMORY_ZONE_KERNEL], order);
+    if ( NULL == z->pcp ) {
+        return -1;
+    }
+    kmemset(z->pcp, 0, sizeof(phys_memory_pcp_t) * nr);
+
+    return 0;
+}
+
+/*
+ * Initialize the per-CPU page caches for nr processors
+ */
+int
+phys_mem_pcp_init(phys_memory_t *mem, int nr)
+{
+    int i;
+
+    for ( i = 0; i < MEMORY_ZONE_CORE_NUM; i++ ) {
+        if ( _pcp_zone_init(mem, &mem->czones[i], nr) < 0 ) {
+            return -1;
+        }
+    }
+    if ( NULL != mem->numazones ) {
+        for ( i = 0; i <= mem->max_domain; i++ ) {
+            if ( _pcp_zone_init(mem, &mem->numazones[i], nr) < 0 ) {
+                return -1;
             }
         }
-        cur = &(*cur)->next;
     }
+    mem->nr_cpus = nr;
+
+    return 0;
 }
 
 /*
- * Insert the block to the buddy system
+ * Return all the blocks held in the per-CPU page caches of a zone to the buddy
+ * system
  */
 static void
-_insert_buddy(phys_memory_buddy_page_t **buddy, uintptr_t addr, int order)
+_pcp_drain_zone(phys_memory_t *mem, phys_memory_zone_t *z)
 {
-    phys_memory_buddy_page_t *block;
-    phys_memory_buddy_page_t **cur;
+    phys_memory_pcp_t *pcp;
+    int i;
+    int order;
 
-    if ( order > MEMORY_PHYS_BUDDY_ORDER ) {
+    if ( NULL == z->pcp ) {
         return;
     }
-
-    /* Search the position to insert */
-    cur = &buddy[order];
-    while ( *cur ) {
-        if ( addr < (uintptr_t)(*cur) ) {
-            /* Insert here */
-            break;
+    for ( i = 0; i < mem->nr_cpus; i++ ) {
+        pcp = &z->pcp[i];
+        spin_lock(&pcp->lock);
+        for ( order = 0; order <= MEMORY_PCP_ORDER; order++ ) {
+            _pcp_drain(mem, z, pcp, order, pcp->count[order]);
         }
-        cur = &(*cur)->next;
+        spin_unlock(&pcp->lock);
     }
+}
 
-    /* Insert at the tail */
-    block = (phys_memory_buddy_page_t *)addr;
-    block->next = *cur;
-    *cur = block;
-    _merge_buddy(buddy, order);
+/*
+ * Return all the pages in the pre-zeroed pool of a zone to the buddy system
+ */
+static void
+_zeroed_drain_zone(phys_memory_t *mem, phys_memory_zone_t *z)
+{
+    void *ptr;
+
+    while ( NULL != (ptr = _zeroed_pop(z)) ) {
+        spin_lock(&mem->lock);
+        phys_mem_buddy_free(z, ptr, 0);
+        spin_unlock(&mem->lock);
+    }
 }
 
 /*
- * Release pages
+ * Return all the blocks held in the per-CPU page caches and the pre-zeroed
+ * pools of all zones
  */
 void
-phys_mem_buddy_free(phys_memory_buddy_page_t **buddy, void *ptr, int order)
+phys_mem_pcp_drain(phys_memory_t *mem)
 {
-    _insert_buddy(buddy, (uintptr_t)ptr, order);
+    int i;
+
+    for ( i = 0; i < MEMORY_ZONE_CORE_NUM; i++ ) {
+        _pcp_drain_zone(mem, &mem->czones[i]);
+        _zeroed_drain_zone(mem, &mem->czones[i]);
+    }
+    if ( NULL != mem->numazones ) {
+        for ( i = 0; i <= mem->max_domain; i++ ) {
+            _pcp_drain_zone(mem, &mem->numazones[i]);
+            _zeroed_drain_zone(mem, &mem->numazones[i]);
+        }
+    }
 }
-void
-phys_mem_free(phys_memory_t *mem, void *ptr, int order, int zone, int domain)
+
+/*
+ * Zero a free page with non-temporal stores and add it to the pool of the zone
+ * if below the watermark.  Return 1 if a page was added.
+ */
+static int
+_zeroed_fill_zone(phys_memory_t *mem, phys_memory_zone_t *z)
 {
-    spin_lock(&mem->lock);
+    phys_memory_buddy_page_t *page;
 
-    /* Physical to virtual */
-    if ( NULL != ptr ) {
-        ptr = ptr + mem->p2v;
+    if ( NULL == z->bitmap || z->zeroed.count >= MEMORY_ZEROED_HIGH ) {
+        return 0;
+    }
+    spin_lock(&mem->lock);
+    page = phys_mem_buddy_alloc(z, 0);
+    spin_unlock(&mem->lock);
+    if ( NULL == page ) {
+        return 0;
     }
 
-    if ( MEMORY_ZONE_DMA == zone || MEMORY_ZONE_KERNEL == zone ) {
-        phys_mem_buddy_free(mem->czones[zone].heads, ptr, order);
-    } else if ( MEMORY_ZONE_NUMA_AWARE == zone ) {
-        if ( domain <= mem->max_domain ) {
-            phys_mem_buddy_free(mem->numazones[domain].heads, ptr, order);
+    /* Clear without polluting the cache */
+    kmemzero_nt(page, MEMORY_PAGESIZE);
+
+    spin_lock(&z->zeroed.lock);
+    page->next = z->zeroed.head;
+    z->zeroed.head = page;
+    z->zeroed.count++;
+    spin_unlock(&z->zeroed.lock);
+
+    return 1;
+}
+
+/*
+ * Add a pre-zeroed page to the first pool below the watermark (the kernel zone
+ * and the NUMA-aware zones; called from the idle task).  Return 0 if all the
+ * pools are full or no free page is left.
+ */
+int
+phys_mem_zeroed_fill(phys_memory_t *mem)
+{
+    int i;
+
+    if ( _zeroed_fill_zone(mem, &mem->czones[MEMORY_ZONE_KERNEL]) ) {
+        return 1;
+    }
+    if ( NULL != mem->numazones ) {
+        for ( i = 0; i <= mem->max_domain; i++ ) {
+            if ( _zeroed_fill_zone(mem, &mem->numazones[i]) ) {
+                return 1;
+            }
         }
     }
 
-    spin_unlock(&mem->lock);
+    return 0;
 }
 
 /*
@@ -350,25 +965,34 @@ phys_memory_init(phys_memory_t *mem, int nr, memory_sysmap_entry_t *map,
         }
         if ( next > MEMORY_ZONE_KERNEL_LB ) {
             /* At least one page for the kernel zone */
-            kbase = MEMORY_ZONE_KERNEL_LB;
+            kbase = base > MEMORY_ZONE_KERNEL_LB
+                ? base : MEMORY_ZONE_KERNEL_LB;
 
             /* Add this region to the buddy system */
-            phys_mem_buddy_add_region(mem->czones[MEMORY_ZONE_KERNEL].heads,
-                                      base + p2v, next + p2v);
+            phys_mem_buddy_add_region(&mem->czones[MEMORY_ZONE_KERNEL],
+                                      kbase + p2v, next + p2v);
         } else {
             kbase = next;
         }
         if ( base < MEMORY_ZONE_KERNEL_LB ) {
             /* At least one page for the DMA zone, then add this region to the
                buddy system */
-            phys_mem_buddy_add_region(mem->czones[MEMORY_ZONE_DMA].heads,
-                                      base + p2v, next + p2v);
+            phys_mem_buddy_add_region(&mem->czones[MEMORY_ZONE_DMA],
+                                      base + p2v, kbase + p2v);
         }
     }
 
     /* Set the p2v offset */
     mem->p2v = p2v;
 
+    /* Track the buddies (the bitmaps are taken from the kernel zone) */
+    if ( phys_mem_buddy_track(mem, &mem->czones[MEMORY_ZONE_KERNEL]) < 0 ) {
+        return -1;
+    }
+    if ( phys_mem_buddy_track(mem, &mem->czones[MEMORY_ZONE_DMA]) < 0 ) {
+        return -1;
+    }
+
     /* Mark that DMA and kernel zones are initialized */
     mem->czones[MEMORY_ZONE_DMA].valid = 1;
     mem->czones[MEMORY_ZONE_KERNEL].valid = 1;
@@ -73,6 +73,20 @@ _alloc_vmem(void)
         return NULL;
     }
 
+    /* Map the time page (read-only) */
+    b = virt_memory_block_add(vmem, TIMEPAGE_ADDR,
+                              TIMEPAGE_ADDR + MEMORY_PAGESIZE - 1);
+    if ( NULL == b ) {
+        /* ToDo: Release vmem */
+        return NULL;
+    }
+    e = virt_memory_alloc_entry(vmem, g_kvar->timepage_obj, TIMEPAGE_ADDR,
+                                MEMORY_PAGESIZE, 0, MEMORY_VMF_SHARED);
+    if ( NULL == e ) {
+        /* ToDo: Release vmem */
+        return NULL;
+    }
+
     return vmem;
 }
 
@@ -85,7 +99,7 @@ proc_new(pid_t pid)
     proc_t *proc;
 
     /* Allocate proc_t */
-    proc = memory_slab_alloc(&g_kvar->slab, SLAB_PROC);
+    proc = kmem_slab_cache_alloc(g_kvar->task_mgr.proc_cache);
     if ( NULL == proc ) {
         return NULL;
     }
@@ -94,7 +108,7 @@ proc_new(pid_t pid)
     /* Allocate a virtual memory */
     proc->vmem = _alloc_vmem();
     if ( NULL == proc->vmem ) {
-        memory_slab_free(&g_kvar->slab, SLAB_PROC, proc);
+        kmem_slab_cache_free(g_kvar->task_mgr.proc_cache, proc);
         return NULL;
     }
 
@@ -102,7 +116,7 @@ proc_new(pid_t pid)
     proc->task = task_alloc();
     if ( NULL == proc->task ) {
         /* ToDo: Free vmem */
-        memory_slab_free(&g_kvar->slab, SLAB_PROC, proc);
+        kmem_slab_cache_free(g_kvar->task_mgr.proc_cache, proc);
         return NULL;
     }
     proc->task->proc =  proc;
@@ -132,7 +146,7 @@ proc_fork(proc_t *op, pid_t pid)
     int ret;
 
     /* Allocate proc_t */
-    np = memory_slab_alloc(&g_kvar->slab, SLAB_PROC);
+    np = kmem_slab_cache_alloc(g_kvar->task_mgr.proc_cache);
     if ( NULL == np ) {
         return NULL;
     }
@@ -141,12 +155,12 @@ proc_fork(proc_t *op, pid_t pid)
     /* Allocate a virtual memory */
     np->vmem = g_kvar->mm.ifs.new();
     if ( NULL == np->vmem ) {
-        memory_slab_free(&g_kvar->slab, SLAB_PROC, np);
+        kmem_slab_cache_free(g_kvar->task_mgr.proc_cache, np);
         return NULL;
     }
     ret = virt_memory_fork(np->vmem, op->vmem);
     if ( ret < 0 ) {
-        memory_slab_free(&g_kvar->slab, SLAB_PROC, np);
+        kmem_slab_cache_free(g_kvar->task_mgr.proc_cache, np);
         return NULL;
     }
 
@@ -154,7 +168,7 @@ proc_fork(proc_t *op, pid_t pid)
     np->task = task_alloc();
     if ( NULL == np->task ) {
         /* ToDo: Free vmem */
-        memory_slab_free(&g_kvar->slab, SLAB_PROC, np);
+        kmem_slab_cache_free(g_kvar->task_mgr.proc_cache, np);
         return NULL;
     }
     np->task->proc =  np;
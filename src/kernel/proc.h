@@ -37,7 +37,7 @@
 
 #define PROC_PROG_ADDR          0x80000000ULL
 #define PROC_PROG_SIZE          0x40000000ULL
-#define PROC_STACK_SIZE         0x10000
+#define PROC_STACK_SIZE         0x100000 /* Populated on demand */
 #define PROC_NR                 65536
 
 #define FD_MAX                  1024
@@ -26,27 +26,438 @@
 #include "kvar.h"
 
 /*
- * High level scheduler
+ * Weights of the nice values from SCHED_NICE_MIN to SCHED_NICE_MAX; each step
+ * changes the share of the processor by around 10%
+ */
+static const int _weights[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15,
+};
+
+/*
+ * Initialize the scheduler with the run queues for nr processors
+ */
+int
+sched_init(int nr)
+{
+    int i;
+    int npg;
+    sched_runqueue_t *rqs;
+
+    npg = (sizeof(sched_runqueue_t) * nr + MEMORY_PAGESIZE - 1)
+        / MEMORY_PAGESIZE;
+    rqs = memory_alloc_pages(&g_kvar->mm, npg, MEMORY_ZONE_KERNEL, 0, 0);
+    if ( NULL == rqs ) {
+        return -1;
+    }
+    for ( i = 0; i < nr; i++ ) {
+        rqs[i].lock = 0;
+        rqs[i].online = 0;
+        rqs[i].nr = 0;
+        rqs[i].min_vruntime = 0;
+        rqs[i].curr = NULL;
+        rqs[i].tree = NULL;
+        rqs[i].first = NULL;
+    }
+    g_kvar->sched.nr = nr;
+    g_kvar->sched.rqs = rqs;
+
+    return 0;
+}
+
+/*
+ * Mark the processor as available for scheduling
  */
 void
-sched_schedule(void)
+sched_cpu_up(int cpu)
+{
+    g_kvar->sched.rqs[cpu].online = 1;
+}
+
+/*
+ * Compare the virtual runtimes of two tasks
+ */
+static int
+_comp(void *a, void *b)
+{
+    task_t *x;
+    task_t *y;
+
+    x = a;
+    y = b;
+    if ( x->vruntime == y->vruntime ) {
+        return 0;
+    }
+
+    return x->vruntime > y->vruntime ? 1 : -1;
+}
+
+/*
+ * Get the task with the smallest virtual runtime in the tree
+ */
+static __inline__ task_t *
+_first(btree_node_t *n)
+{
+    if ( NULL == n ) {
+        return NULL;
+    }
+    while ( NULL != n->left ) {
+        n = n->left;
+    }
+
+    return n->data;
+}
+
+/*
+ * Insert a task to the run queue in the order of the virtual runtime (the
+ * lock must be held).  N.B., the virtual runtime of a queued task must not be
+ * changed.
+ */
+static __inline__ void
+_push(sched_runqueue_t *rq, task_t *t)
+{
+    int ret;
+
+    ret = btree_add(&rq->tree, &t->rqnode, _comp, 1);
+    kassert(ret == 0);
+    rq->first = _first(rq->tree);
+    rq->nr++;
+}
+
+/*
+ * Detach the first task whose context is not loaded on any processor (the
+ * lock must be held)
+ */
+static __inline__ task_t *
+_pop(sched_runqueue_t *rq)
+{
+    btree_node_t *stack[BTREE_MAX_HEIGHT];
+    btree_node_t *n;
+    task_t *t;
+    int sp;
+
+    /* In-order traversal from the smallest virtual runtime; a task switching
+       out is rarely found */
+    sp = 0;
+    n = rq->tree;
+    while ( NULL != n || sp > 0 ) {
+        if ( NULL != n ) {
+            stack[sp++] = n;
+            n = n->left;
+            continue;
+        }
+        n = stack[--sp];
+        t = n->data;
+        if ( !t->oncpu ) {
+            btree_delete(&rq->tree, &t->rqnode, _comp);
+            rq->first = _first(rq->tree);
+            rq->nr--;
+            return t;
+        }
+        n = n->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Place the virtual runtime of a task joining the run queue not too far
+ * behind the others so that it does not monopolize the processor
+ */
+static __inline__ void
+_place(sched_runqueue_t *rq, task_t *t, uint64_t credit)
+{
+    uint64_t min;
+
+    min = rq->min_vruntime > credit ? rq->min_vruntime - credit : 0;
+    if ( t->vruntime < min ) {
+        t->vruntime = min;
+    }
+}
+
+/*
+ * Kick an idle processor to steal tasks waiting in the run queue of the
+ * specified processor (the timer of idle processors is stopped)
+ */
+static void
+_kick_idle(int cpu)
 {
     int i;
+    sched_runqueue_t *rq;
+
+    for ( i = 0; i < g_kvar->sched.nr; i++ ) {
+        rq = &g_kvar->sched.rqs[i];
+        if ( i != cpu && rq->online && NULL == rq->curr && 0 == rq->nr ) {
+            task_resched(i);
+            return;
+        }
+    }
+}
+
+/*
+ * Make a created or blocked task ready, and add it to the run queue of the
+ * processor it belongs to
+ */
+void
+sched_wakeup(task_t *t)
+{
+    sched_runqueue_t *rq;
+    int cpu;
+    int resched;
+    int kick;
+
+    /* N.B., t->cpu of a created or blocked task is not changed by others as it
+       is not in any run queue. */
+    cpu = t->cpu;
+    rq = &g_kvar->sched.rqs[cpu];
+    resched = 0;
+    spin_lock(&rq->lock);
+    if ( TASK_CREATED == t->state || TASK_BLOCKED == t->state ) {
+        _place(rq, t, TASK_BLOCKED == t->state ? SCHED_SLEEPER_CREDIT : 0);
+        t->state = TASK_READY;
+        if ( !t->queued ) {
+            /* The task may still be switching out if it has just blocked; it
+               is not picked until its context is saved (t->oncpu). */
+            t->queued = 1;
+            _push(rq, t);
+        }
+        /* Preempt the running task if the woken task is far behind it */
+        if ( rq->online && (NULL == rq->curr
+                            || t->vruntime + SCHED_WAKEUP_GRAN
+                            < rq->curr->vruntime) ) {
+            resched = 1;
+        }
+    }
+    kick = !resched && rq->nr > 0;
+    spin_unlock(&rq->lock);
+
+    if ( resched ) {
+        task_resched(cpu);
+    } else if ( kick ) {
+        _kick_idle(cpu);
+    }
+}
+
+/*
+ * Move the half of the tasks in the busiest run queue to the run queue of the
+ * specified processor
+ */
+static int
+_steal(int cpu)
+{
+    int i;
+    int max;
+    int n;
+    int64_t delta;
+    uint64_t vmin;
+    sched_runqueue_t *rq;
+    sched_runqueue_t *victim;
     task_t *t;
-    task_t **rq;
+    task_t *head;
 
-    rq = &g_kvar->runqueue;
-    for ( i = 0; i < PROC_NR; i++ ) {
-        if ( NULL != g_kvar->procs[i] ) {
-            t = g_kvar->procs[i]->task;
-            if ( NULL != t && TASK_READY == t->state ) {
-                /* Add to the run queue */
-                t->credit = 10;
-                t->next = *rq;
-                *rq = t;
-            }
+    /* Find the busiest run queue */
+    victim = NULL;
+    max = 0;
+    for ( i = 0; i < g_kvar->sched.nr; i++ ) {
+        rq = &g_kvar->sched.rqs[i];
+        if ( i != cpu && rq->online && rq->nr > max ) {
+            max = rq->nr;
+            victim = rq;
         }
     }
+    if ( NULL == victim ) {
+        return 0;
+    }
+
+    /* Detach tasks from the victim.  N.B., the two locks are never held at
+       the same time to avoid deadlocks between stealing processors. */
+    n = 0;
+    head = NULL;
+    spin_lock(&victim->lock);
+    vmin = victim->min_vruntime;
+    max = (victim->nr + 1) / 2;
+    while ( n < max ) {
+        t = _pop(victim);
+        if ( NULL == t ) {
+            break;
+        }
+        t->next = head;
+        head = t;
+        n++;
+    }
+    spin_unlock(&victim->lock);
+
+    /* Attach them to the local run queue with the virtual runtime relative to
+       the local one */
+    rq = &g_kvar->sched.rqs[cpu];
+    spin_lock(&rq->lock);
+    while ( NULL != head ) {
+        t = head;
+        head = head->next;
+        delta = (int64_t)(t->vruntime - vmin);
+        if ( delta < 0 && (uint64_t)-delta > rq->min_vruntime ) {
+            t->vruntime = 0;
+        } else {
+            t->vruntime = rq->min_vruntime + delta;
+        }
+        t->cpu = cpu;
+        _push(rq, t);
+    }
+    spin_unlock(&rq->lock);
+
+    return n;
+}
+
+/*
+ * Low level scheduler: pick the task with the smallest virtual runtime from
+ * the run queue of the specified processor, or steal tasks from the busiest
+ * one if it is empty
+ */
+task_t *
+sched_pick_next(int cpu)
+{
+    sched_runqueue_t *rq;
+    task_t *t;
+
+    rq = &g_kvar->sched.rqs[cpu];
+    do {
+        spin_lock(&rq->lock);
+        t = _pop(rq);
+        if ( NULL != t ) {
+            t->queued = 0;
+            t->oncpu = 1;
+            t->state = TASK_RUNNING;
+            t->credit = SCHED_QUANTUM;
+        }
+        spin_unlock(&rq->lock);
+    } while ( NULL == t && _steal(cpu) > 0 );
+
+    return t;
+}
+
+/*
+ * Charge ticks to the task running on the specified processor.  This returns
+ * a non-zero value if the task has consumed its quantum and another task
+ * should run.
+ */
+int
+sched_tick(int cpu, task_t *t, int ticks)
+{
+    sched_runqueue_t *rq;
+    uint64_t min;
+    int resched;
+
+    rq = &g_kvar->sched.rqs[cpu];
+
+    /* Advance the virtual runtime inversely proportional to the weight */
+    t->vruntime += (uint64_t)ticks * SCHED_NICE0_WEIGHT * SCHED_NICE0_WEIGHT
+        / _weights[t->nice - SCHED_NICE_MIN];
+
+    resched = 0;
+    spin_lock(&rq->lock);
+    min = t->vruntime;
+    if ( NULL != rq->first && rq->first->vruntime < min ) {
+        min = rq->first->vruntime;
+    }
+    if ( min > rq->min_vruntime ) {
+        rq->min_vruntime = min;
+    }
+    t->credit -= ticks;
+    if ( t->credit <= 0 ) {
+        /* Renew the quantum unless a task with smaller virtual runtime is
+           waiting */
+        t->credit = SCHED_QUANTUM;
+        if ( NULL != rq->first && rq->first->vruntime < t->vruntime ) {
+            resched = 1;
+        }
+    }
+    spin_unlock(&rq->lock);
+
+    return resched;
+}
+
+/*
+ * Check if the task running on the specified processor should be preempted by
+ * a queued task
+ */
+int
+sched_preempt(int cpu, task_t *t)
+{
+    sched_runqueue_t *rq;
+    int resched;
+
+    rq = &g_kvar->sched.rqs[cpu];
+    spin_lock(&rq->lock);
+    resched = (NULL != rq->first
+               && rq->first->vruntime + SCHED_WAKEUP_GRAN < t->vruntime);
+    spin_unlock(&rq->lock);
+
+    return resched;
+}
+
+/*
+ * Called once the context is switched from prev to next on the specified
+ * processor; NULL denotes the idle task.
+ */
+void
+sched_switched(int cpu, task_t *prev, task_t *next)
+{
+    sched_runqueue_t *rq;
+    int kick;
+
+    rq = &g_kvar->sched.rqs[cpu];
+    spin_lock(&rq->lock);
+    rq->curr = next;
+    if ( NULL != prev && (TASK_RUNNING == prev->state
+                          || TASK_READY == prev->state) && !prev->queued ) {
+        /* Preempted; put it back to the run queue */
+        prev->state = TASK_READY;
+        prev->cpu = cpu;
+        prev->queued = 1;
+        _push(rq, prev);
+    }
+    /* Blocked or terminated tasks are not queued until they are woken up by
+       sched_wakeup().  The task can be picked from now; t->queued and
+       t->oncpu are only changed and checked with the lock of the run queue of
+       t->cpu held, which is this processor while the task is on it. */
+    if ( NULL != prev ) {
+        prev->oncpu = 0;
+    }
+    kick = NULL != next && rq->nr > 0;
+    spin_unlock(&rq->lock);
+
+    if ( kick ) {
+        _kick_idle(cpu);
+    }
+}
+
+/*
+ * Get the nice value of a task
+ */
+int
+sched_get_nice(task_t *t)
+{
+    return t->nice;
+}
+
+/*
+ * Set the nice value of a task; it takes effect from the next tick
+ */
+void
+sched_set_nice(task_t *t, int nice)
+{
+    if ( nice < SCHED_NICE_MIN ) {
+        nice = SCHED_NICE_MIN;
+    } else if ( nice > SCHED_NICE_MAX ) {
+        nice = SCHED_NICE_MAX;
+    }
+    t->nice = nice;
 }
 
 /*
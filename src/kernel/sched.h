@@ -26,14 +26,65 @@
 
 #include <stdint.h>
 #include "proc.h"
+#include "tree.h"
+
+/* Minimum quantum (in ticks) assigned to a dispatched task */
+#define SCHED_QUANTUM           10
+
+/* Range of the nice value */
+#define SCHED_NICE_MIN          (-20)
+#define SCHED_NICE_MAX          19
+
+/* Weight of nice 0; a tick of a nice-0 task advances its virtual runtime by
+   this value */
+#define SCHED_NICE0_WEIGHT      1024
+
+/* A woken task preempts the running task if its virtual runtime is smaller by
+   this granularity */
+#define SCHED_WAKEUP_GRAN       SCHED_NICE0_WEIGHT
+
+/* Virtual runtime credited to a task woken up from sleep */
+#define SCHED_SLEEPER_CREDIT    (SCHED_QUANTUM * SCHED_NICE0_WEIGHT / 2)
+
+/*
+ * Per-processor run queue
+ */
+typedef struct {
+    /* Lock */
+    int lock;
+    /* Set when the processor starts scheduling */
+    int online;
+    /* Number of queued tasks */
+    int nr;
+    /* Monotonically increasing minimum virtual runtime of this run queue */
+    uint64_t min_vruntime;
+    /* Task running on this processor (NULL when idle) */
+    task_t *curr;
+    /* Queued tasks (balanced tree sorted by the virtual runtime) */
+    btree_node_t *tree;
+    /* Queued task with the smallest virtual runtime (the leftmost node) */
+    task_t *first;
+} __attribute__ ((aligned(64))) sched_runqueue_t;
 
 /*
  * Scheduler
  */
 typedef struct {
+    /* Number of run queues (indexed by the processor ID) */
+    int nr;
+    /* Run queues */
+    sched_runqueue_t *rqs;
 } sched_t;
 
-void sched_schedule(void);
+int sched_init(int);
+void sched_cpu_up(int);
+void sched_wakeup(task_t *);
+task_t * sched_pick_next(int);
+int sched_tick(int, task_t *, int);
+int sched_preempt(int, task_t *);
+void sched_switched(int, task_t *, task_t *);
+int sched_get_nice(task_t *);
+void sched_set_nice(task_t *, int);
 
 #endif
 
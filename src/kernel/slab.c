@@ -24,46 +24,57 @@
 #include "memory.h"
 #include "kernel.h"
 
+/* Slab header of an object */
+#define SLAB_HDR(obj)                                                   \
+    ((memory_slab_hdr_t *)((uintptr_t)(obj) & ~(MEMORY_SLAB_SIZE - 1)))
+
 /*
- * Allocate a slab
+ * Allocate a slab; the objects are shifted by the color (rotating over the
+ * cache lines of the slack) so that the objects at the same index in
+ * different slabs do not map to the same cache sets
  */
 static memory_slab_hdr_t *
-_new_slab(memory_slab_allocator_t *slab, size_t objsize)
+_new_slab(memory_slab_allocator_t *slab, size_t objsize, int color)
 {
     void *pages;
     uintptr_t addr;
     volatile memory_slab_hdr_t *hdr;
     size_t size;
-    int i;
+    size_t ncolors;
 
-    /* Allocate pages for slab */
+    /* Allocate pages for slab; aligned so that the header is found from the
+       address of an object */
     pages = memory_alloc_pages(slab->mem, MEMORY_SLAB_NUM_PAGES,
-                               MEMORY_ZONE_NUMA_AWARE, 0);
+                               MEMORY_ZONE_NUMA_AWARE, MEMORY_DOMAIN_ANY,
+                               MEMORY_ALLOC_ZEROED | MEMORY_ALLOC_ALIGNED);
     if ( NULL == pages ) {
         return NULL;
     }
 
-    size = MEMORY_PAGESIZE * MEMORY_SLAB_NUM_PAGES;
-    kmemset(pages, 0, size);
+    size = MEMORY_SLAB_SIZE;
     hdr = pages;
 
     hdr->next = NULL;
+    hdr->prev = NULL;
     hdr->cache = NULL;
 
     /* Calculate the number of objects (64 byte alignment) */
     size = size - sizeof(memory_slab_hdr_t) - MEMORY_SLAB_ALIGNMENT;
-    /* object and mark */
-    hdr->nobjs = size / (objsize + 1);
+    hdr->nobjs = size / objsize;
 
     /* Calculate the pointer to the object array */
-    addr = (uintptr_t)pages + sizeof(memory_slab_hdr_t) + hdr->nobjs;
+    addr = (uintptr_t)pages + sizeof(memory_slab_hdr_t);
     addr = ((addr + MEMORY_SLAB_ALIGNMENT - 1) / MEMORY_SLAB_ALIGNMENT)
         * MEMORY_SLAB_ALIGNMENT;
+    ncolors = (MEMORY_SLAB_SIZE - (addr - (uintptr_t)pages)
+               - hdr->nobjs * objsize) / MEMORY_SLAB_ALIGNMENT + 1;
+    addr += (color % ncolors) * MEMORY_SLAB_ALIGNMENT;
     hdr->obj_head = (void *)addr;
-    /* Mark all objects free */
-    for ( i = 0; i < hdr->nobjs; i++ ) {
-        hdr->marks[i] = 1;
-    }
+
+    /* Objects are handed out in order first, so none of them is touched
+       until allocated */
+    hdr->free = NULL;
+    hdr->nfresh = 0;
 
     return (memory_slab_hdr_t *)hdr;
 }
@@ -122,234 +133,414 @@ _add_slab_cache(memory_slab_cache_t **t, memory_slab_cache_t *n)
 
 
 /*
- * Allocate an object from the slab cache specified by the name
+ * Add a slab to the head of a list
  */
-static void *
-_slab_alloc(memory_slab_allocator_t *slab, const char *name)
+static __inline__ void
+_list_push(memory_slab_hdr_t **head, memory_slab_hdr_t *s)
 {
-    memory_slab_cache_t *c;
-    memory_slab_hdr_t *s;
-    int i;
-    void *obj;
-
-    /* Find the slab cache corresponding to the name */
-    c = _find_slab_cache(slab->root, name);
-    if ( NULL == c ) {
-        /* Not found */
-        return NULL;
+    s->prev = NULL;
+    s->next = *head;
+    if ( NULL != s->next ) {
+        s->next->prev = s;
     }
+    *head = s;
+}
 
-    if ( NULL == c->freelist.partial && NULL == c->freelist.full ) {
-        /* No object found, then try to allocate a new slab */
-        s = _new_slab(slab, c->size);
-        if ( NULL == s ) {
-            /* Could not allocate a new slab */
-            return NULL;
-        }
-        s->cache = c;
-        c->freelist.full = s;
+/*
+ * Remove a slab from a list
+ */
+static __inline__ void
+_list_remove(memory_slab_hdr_t **head, memory_slab_hdr_t *s)
+{
+    if ( NULL != s->prev ) {
+        s->prev->next = s->next;
+    } else {
+        *head = s->next;
+    }
+    if ( NULL != s->next ) {
+        s->next->prev = s->prev;
     }
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+/*
+ * Allocate an object from the slab cache (the lock must be held)
+ */
+static void *
+_cache_alloc(memory_slab_allocator_t *slab, memory_slab_cache_t *c)
+{
+    memory_slab_hdr_t *s;
+    void *obj;
 
     if ( NULL == c->freelist.partial ) {
-        kassert( c->freelist.full != NULL );
-        /* Take one full slab to the partial */
-        c->freelist.partial = c->freelist.full;
-        c->freelist.full = c->freelist.full->next;
+        if ( NULL != c->freelist.full ) {
+            /* Take one full slab to the partial */
+            s = c->freelist.full;
+            _list_remove(&c->freelist.full, s);
+            c->nfull--;
+        } else {
+            /* No object found, then try to allocate a new slab */
+            s = _new_slab(slab, c->size, c->color++);
+            if ( NULL == s ) {
+                /* Could not allocate a new slab */
+                return NULL;
+            }
+            s->cache = c;
+        }
+        _list_push(&c->freelist.partial, s);
     }
 
-    /* Get an object */
+    /* Get an object from the free list, or the first one never allocated */
     s = c->freelist.partial;
-    obj = NULL;
-    for ( i = 0; i < s->nobjs; i ++ ) {
-        if ( s->marks[i] ) {
-            /* Found a free object */
-            obj = s->obj_head + c->size * i;
-            s->marks[i] = 0;
-            s->nused++;
-            break;
-        }
+    obj = s->free;
+    if ( NULL != obj ) {
+        s->free = *(void **)obj;
+    } else {
+        kassert( s->nfresh < s->nobjs );
+        obj = s->obj_head + c->size * s->nfresh;
+        s->nfresh++;
     }
+    s->nused++;
 
     /* Check if the slab is still partial or becomes empty */
     if ( s->nused == s->nobjs ) {
         /* Move this partial slab to the empty free list */
-        c->freelist.partial = s->next;
-        s->next = c->freelist.empty;
-        c->freelist.empty = s;
+        _list_remove(&c->freelist.partial, s);
+        _list_push(&c->freelist.empty, s);
     }
 
     return obj;
 }
-void *
-memory_slab_alloc(memory_slab_allocator_t *slab, const char *name)
+
+/*
+ * Free an object to the slab (the lock must be held); the slab is released if
+ * it becomes unused beyond the watermark of the cache
+ */
+static void
+_cache_free(memory_slab_allocator_t *slab, memory_slab_cache_t *c,
+            memory_slab_hdr_t *s, void *obj)
 {
-    void *obj;
+    if ( s->nused == s->nobjs ) {
+        /* Remove from emtpy, then add to the partial */
+        _list_remove(&c->freelist.empty, s);
+        _list_push(&c->freelist.partial, s);
+    }
 
-    spin_lock(&slab->lock);
-    obj = _slab_alloc(slab, name);
-    spin_unlock(&slab->lock);
+    /* Push it to the free list */
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->nused--;
 
-    return obj;
+    if ( s->nused == 0 ) {
+        /* Remove from partial, then add to the full or release */
+        _list_remove(&c->freelist.partial, s);
+        if ( c->nfull >= MEMORY_SLAB_RETAIN ) {
+            memory_free_pages(slab->mem, s);
+        } else {
+            _list_push(&c->freelist.full, s);
+            c->nfull++;
+        }
+    }
 }
 
 /*
- * Search a slab containing to the object
+ * Get the per-CPU magazines of this processor.  The caller must run with
+ * interrupts disabled so that the task is neither preempted nor migrated while
+ * using them; this holds in the kernel as system calls are entered with IF
+ * cleared (FMASK) and exceptions including the page fault through interrupt
+ * gates.
  */
-static memory_slab_hdr_t *
-_find_slab_for_object(memory_slab_cache_t *c, memory_slab_hdr_t *h, void *obj)
+static memory_slab_cpu_t *
+_get_cpu(memory_slab_allocator_t *slab, memory_slab_cache_t *c)
 {
-    memory_slab_hdr_t *s;
-    uintptr_t addr;
-    uintptr_t start;
-    uintptr_t end;
-
-    /* Address of the object */
-    addr = (uintptr_t)obj;
-
-    /* Search a slab containing the object */
-    s = h;
-    while ( NULL != s ) {
-        start = (uintptr_t)s->obj_head;
-        end = start + c->size * s->nobjs;
-        if ( addr >= start && addr < end ) {
-            return s;
-        }
-        s = s->next;
+    int id;
+
+    if ( NULL == c->cpu ) {
+        return NULL;
+    }
+    id = this_cpu_id();
+    if ( id < 0 || id >= slab->nr_cpus ) {
+        return NULL;
     }
 
-    return NULL;
+    return &c->cpu[id];
 }
 
 /*
- * Free an object to the slab cache
+ * Allocate an object from the magazines of this processor; exchange an empty
+ * magazine for a full one in the depot if both are empty.  No lock is taken
+ * for the magazines (see _get_cpu()).
  */
-int
-memory_slab_free(memory_slab_allocator_t *slab, const char *name, void *obj)
+static void *
+_mag_alloc(memory_slab_allocator_t *slab, memory_slab_cache_t *c)
 {
-    memory_slab_cache_t *c;
-    memory_slab_hdr_t *s;
-    int waspartial;
-    memory_slab_hdr_t **head;
-    uintptr_t off;
-    int idx;
-
-    spin_lock(&slab->lock);
+    memory_slab_cpu_t *cpu;
+    memory_slab_magazine_t *m;
 
-    /* Find the slab cache corresponding to the name */
-    c = _find_slab_cache(slab->root, name);
-    if ( NULL == c ) {
-        /* Not found */
-        spin_unlock(&slab->lock);
-        return -1;
+    cpu = _get_cpu(slab, c);
+    if ( NULL == cpu ) {
+        return NULL;
     }
 
-    /* Search a slab containing the object */
-    waspartial = 1;
-    s = _find_slab_for_object(c, c->freelist.partial, obj);
-    if ( NULL == s ) {
-        /* Not found, then try to search empty list */
-        waspartial = 0;
-        s = _find_slab_for_object(c, c->freelist.empty, obj);
-        if ( NULL == s ) {
-            /* Not found */
-            spin_unlock(&slab->lock);
-            return -1;
+    m = cpu->loaded;
+    if ( NULL == m || 0 == m->rounds ) {
+        if ( NULL != cpu->prev && cpu->prev->rounds > 0 ) {
+            /* Swap the loaded and the previous magazines */
+            cpu->loaded = cpu->prev;
+            cpu->prev = m;
+        } else {
+            spin_lock(&c->depot_lock);
+            if ( NULL == c->depot_full ) {
+                spin_unlock(&c->depot_lock);
+                return NULL;
+            }
+            if ( NULL != cpu->prev ) {
+                /* Return the empty previous one to the depot */
+                cpu->prev->next = c->depot_empty;
+                c->depot_empty = cpu->prev;
+            }
+            cpu->prev = m;
+            cpu->loaded = c->depot_full;
+            c->depot_full = c->depot_full->next;
+            spin_unlock(&c->depot_lock);
         }
+        m = cpu->loaded;
     }
 
-    /* Calculate the offset and the index */
-    off = obj - s->obj_head;
-    idx = off / c->size;
-    kassert( idx < s->nobjs );
+    return m->objs[--m->rounds];
+}
 
-    /* Mark as free */
-    s->marks[idx] = 1;
-    s->nused--;
+/*
+ * Free an object to the magazines of this processor; exchange a full magazine
+ * for an empty one in the depot (or a new one) if both are full.  No lock is
+ * taken for the magazines (see _get_cpu()).
+ */
+static int
+_mag_free(memory_slab_allocator_t *slab, memory_slab_cache_t *c, void *obj)
+{
+    memory_slab_cpu_t *cpu;
+    memory_slab_magazine_t *m;
 
-    if ( !waspartial ) {
-        /* Remove from emtpy, then add to the partial */
-        head = &c->freelist.empty;
-        while ( *head ) {
-            if ( *head == s ) {
-                /* Found, then remove s */
-                *head = s->next;
-                break;
-            }
-            head = &(*head)->next;
-        }
-        /* Add it to the partial list */
-        s->next = c->freelist.partial;
-        c->freelist.partial = s;
+    cpu = _get_cpu(slab, c);
+    if ( NULL == cpu ) {
+        return -1;
     }
 
-    if ( s->nused == 0 ) {
-        /* Remove from partial, then add to the full */
-        head = &c->freelist.partial;
-        while ( *head ) {
-            if ( *head == s ) {
-                /* Found, then remove s */
-                *head = s->next;
-                break;
+    m = cpu->loaded;
+    if ( NULL == m || MEMORY_SLAB_MAGAZINE_SIZE == m->rounds ) {
+        if ( NULL != cpu->prev
+             && cpu->prev->rounds < MEMORY_SLAB_MAGAZINE_SIZE ) {
+            /* Swap the loaded and the previous magazines */
+            cpu->loaded = cpu->prev;
+            cpu->prev = m;
+        } else {
+            spin_lock(&c->depot_lock);
+            m = c->depot_empty;
+            if ( NULL != m ) {
+                c->depot_empty = m->next;
             }
-            head = &(*head)->next;
+            spin_unlock(&c->depot_lock);
+            if ( NULL == m ) {
+                /* Allocate a new magazine */
+                spin_lock(&slab->lock);
+                m = _cache_alloc(slab, slab->magazines);
+                spin_unlock(&slab->lock);
+                if ( NULL == m ) {
+                    return -1;
+                }
+                m->rounds = 0;
+            }
+            if ( NULL != cpu->prev ) {
+                /* Return the full previous one to the depot */
+                spin_lock(&c->depot_lock);
+                cpu->prev->next = c->depot_full;
+                c->depot_full = cpu->prev;
+                spin_unlock(&c->depot_lock);
+            }
+            cpu->prev = cpu->loaded;
+            cpu->loaded = m;
         }
-        /* Add it to the full list */
-        s->next = c->freelist.full;
-        c->freelist.full = s;
+        m = cpu->loaded;
+    }
+    m->objs[m->rounds++] = obj;
+
+    return 0;
+}
+
+/*
+ * Allocate an object from the slab cache
+ */
+void *
+memory_slab_cache_alloc(memory_slab_allocator_t *slab, memory_slab_cache_t *c)
+{
+    void *obj;
+
+    if ( NULL == c ) {
+        return NULL;
     }
 
+    /* Try the per-CPU magazines first */
+    obj = _mag_alloc(slab, c);
+    if ( NULL != obj ) {
+        return obj;
+    }
+
+    spin_lock(&slab->lock);
+    obj = _cache_alloc(slab, c);
+    spin_unlock(&slab->lock);
+
+    return obj;
+}
+
+/*
+ * Free an object to the slab cache
+ */
+int
+memory_slab_cache_free(memory_slab_allocator_t *slab, memory_slab_cache_t *c,
+                       void *obj)
+{
+    memory_slab_hdr_t *s;
+
+    if ( NULL == c || NULL == obj ) {
+        return -1;
+    }
+
+    /* Check the object belongs to the cache */
+    s = SLAB_HDR(obj);
+    if ( s->cache != c ) {
+        return -1;
+    }
+
+    /* Try the per-CPU magazines first */
+    if ( 0 == _mag_free(slab, c, obj) ) {
+        return 0;
+    }
+
+    spin_lock(&slab->lock);
+    _cache_free(slab, c, s, obj);
     spin_unlock(&slab->lock);
 
     return 0;
 }
 
 /*
- * Create a new slab cache
+ * Get the slab cache of an object
+ */
+memory_slab_cache_t *
+memory_slab_object_cache(void *obj)
+{
+    return SLAB_HDR(obj)->cache;
+}
+
+/*
+ * Allocate an object from the slab cache specified by the name (compatibility
+ * interface; keep the handle instead in the hot paths).  The cache tree is
+ * only inserted into with fully initialized caches, so it is searched without
+ * the lock.
+ */
+void *
+memory_slab_alloc(memory_slab_allocator_t *slab, const char *name)
+{
+    return memory_slab_cache_alloc(slab, _find_slab_cache(slab->root, name));
+}
+
+/*
+ * Free an object to the slab cache specified by the name (compatibility
+ * interface)
  */
 int
-memory_slab_create_cache(memory_slab_allocator_t *slab, const char *name,
-                         size_t size)
+memory_slab_free(memory_slab_allocator_t *slab, const char *name, void *obj)
+{
+    return memory_slab_cache_free(slab, _find_slab_cache(slab->root, name),
+                                  obj);
+}
+
+/*
+ * Create a new slab cache (the lock must be held); with per-CPU magazines if
+ * mag is non-zero
+ */
+static memory_slab_cache_t *
+_create_cache(memory_slab_allocator_t *slab, const char *name, size_t size,
+              int flags, int mag)
 {
     memory_slab_cache_t *cache;
     memory_slab_hdr_t *s;
+    size_t npg;
     int ret;
 
-    spin_lock(&slab->lock);
-
     /* Duplicate check */
     cache = _find_slab_cache(slab->root, name);
     if ( NULL != cache ) {
         /* Already exists */
-        spin_unlock(&slab->lock);
-        return -1;
+        return NULL;
     }
 
     /* Try to allocate a memory_slab_cache_t from the named slab cache */
-    cache = _slab_alloc(slab, MEMORY_SLAB_CACHE_NAME);
+    cache = _find_slab_cache(slab->root, MEMORY_SLAB_CACHE_NAME);
+    cache = _cache_alloc(slab, cache);
     if ( NULL == cache ) {
-        spin_unlock(&slab->lock);
-        return -1;
+        return NULL;
     }
     kstrlcpy(cache->name, name, MEMORY_SLAB_CACHE_NAME_MAX);
+    /* Objects hold the free list pointer while free */
+    if ( size < sizeof(void *) ) {
+        size = sizeof(void *);
+    }
+    if ( flags & MEMORY_SLAB_CACHE_LINE_ALIGN ) {
+        /* Start every object at a cache line */
+        size = (size + MEMORY_SLAB_ALIGNMENT - 1)
+            & ~(size_t)(MEMORY_SLAB_ALIGNMENT - 1);
+    }
     cache->size = size;
     cache->freelist.partial = NULL;
     cache->freelist.full = NULL;
     cache->freelist.empty = NULL;
+    cache->nfull = 1;
+    cache->color = 1;
     cache->left = NULL;
     cache->right = NULL;
+    cache->cpu = NULL;
+    cache->depot_lock = 0;
+    cache->depot_full = NULL;
+    cache->depot_empty = NULL;
 
     /* Allocate one slab for the full free list */
-    s = _new_slab(slab, size);
+    s = _new_slab(slab, size, 0);
     s->cache = cache;
-    cache->freelist.full = s;
+    _list_push(&cache->freelist.full, s);
+
+    /* Per-CPU magazines (the slab layer is used without them on failure) */
+    if ( mag && slab->nr_cpus > 0 ) {
+        npg = (sizeof(memory_slab_cpu_t) * slab->nr_cpus + MEMORY_PAGESIZE - 1)
+            / MEMORY_PAGESIZE;
+        cache->cpu = memory_alloc_pages(slab->mem, npg, MEMORY_ZONE_KERNEL, 0,
+                                        MEMORY_ALLOC_ZEROED);
+    }
 
-    /* Add to the cache tree */
+    /* Add to the cache tree and the list */
     ret = _add_slab_cache(&slab->root, cache);
     kassert( ret == 0 );
+    cache->next = slab->caches;
+    slab->caches = cache;
+
+    return cache;
+}
+
+/*
+ * Create a new slab cache with MEMORY_SLAB_CACHE_* flags, and return its handle
+ */
+memory_slab_cache_t *
+memory_slab_create_cache(memory_slab_allocator_t *slab, const char *name,
+                         size_t size, int flags)
+{
+    memory_slab_cache_t *cache;
 
+    spin_lock(&slab->lock);
+    cache = _create_cache(slab, name, size, flags, 1);
     spin_unlock(&slab->lock);
 
-    return 0;
+    return cache;
 }
 
 /*
@@ -363,13 +554,13 @@ _slab_cache_init(memory_slab_allocator_t *slab)
     int ret;
 
     /* Allocate one slab for the full free list */
-    s = _new_slab(slab, sizeof(memory_slab_cache_t));
+    s = _new_slab(slab, sizeof(memory_slab_cache_t), 0);
     if ( NULL == s ) {
         return -1;
     }
 
     /* Take the first object */
-    s->marks[0] = 0;
+    s->nfresh++;
     s->nused++;
     cache = s->obj_head;
     kstrlcpy(cache->name, MEMORY_SLAB_CACHE_NAME, MEMORY_SLAB_CACHE_NAME_MAX);
@@ -377,17 +568,86 @@ _slab_cache_init(memory_slab_allocator_t *slab)
     cache->freelist.partial = s;
     cache->freelist.full = NULL;
     cache->freelist.empty = NULL;
+    cache->nfull = 0;
+    cache->color = 1;
     cache->left = NULL;
     cache->right = NULL;
     s->cache = cache;
 
-    /* Add to the cache tree */
+    /* Add to the cache tree and the list */
     ret = _add_slab_cache(&slab->root, cache);
     kassert( ret == 0 );
+    cache->next = NULL;
+    slab->caches = cache;
 
     return 0;
 }
 
+/*
+ * Return the objects in the magazines of the depot to the slabs, and release
+ * the magazines (the lock must be held)
+ */
+static void
+_depot_drain(memory_slab_allocator_t *slab, memory_slab_cache_t *c)
+{
+    memory_slab_magazine_t *m;
+
+    spin_lock(&c->depot_lock);
+    while ( NULL != (m = c->depot_full) ) {
+        c->depot_full = m->next;
+        while ( m->rounds > 0 ) {
+            m->rounds--;
+            _cache_free(slab, c, SLAB_HDR(m->objs[m->rounds]),
+                        m->objs[m->rounds]);
+        }
+        m->next = c->depot_empty;
+        c->depot_empty = m;
+    }
+    while ( NULL != (m = c->depot_empty) ) {
+        c->depot_empty = m->next;
+        _cache_free(slab, slab->magazines, SLAB_HDR(m), m);
+    }
+    spin_unlock(&c->depot_lock);
+}
+
+/*
+ * Shrinker called on memory pressure; drain the depots and release all the
+ * unused slabs.  This gives up if the allocator or the kernel memory is in use
+ * as the allocation may have been made within it.
+ */
+static size_t
+_shrink(void *arg)
+{
+    memory_slab_allocator_t *slab;
+    memory_slab_cache_t *c;
+    memory_slab_hdr_t *s;
+    size_t n;
+
+    slab = arg;
+    if ( spin_trylock(&slab->lock) < 0 ) {
+        return 0;
+    }
+    for ( c = slab->caches; NULL != c; c = c->next ) {
+        _depot_drain(slab, c);
+    }
+    n = 0;
+    for ( c = slab->caches; NULL != c; c = c->next ) {
+        while ( NULL != (s = c->freelist.full) ) {
+            _list_remove(&c->freelist.full, s);
+            if ( memory_try_free_pages(slab->mem, s) < 0 ) {
+                _list_push(&c->freelist.full, s);
+                goto out;
+            }
+            c->nfull--;
+            n += MEMORY_SLAB_NUM_PAGES;
+        }
+    }
+out:
+    spin_unlock(&slab->lock);
+
+    return n;
+}
+
 /*
  * Initialize the slab allocator
  */
@@ -399,6 +659,7 @@ memory_slab_init(memory_slab_allocator_t *slab, memory_t *mem)
     slab->lock = 1;
     slab->mem = mem;
     slab->root = NULL;
+    slab->nr_cpus = mem->phys->nr_cpus;
 
     /* Create a slab cache for slab cache */
     ret = _slab_cache_init(slab);
@@ -406,13 +667,25 @@ memory_slab_init(memory_slab_allocator_t *slab, memory_t *mem)
         return -1;
     }
 
+    /* Create a slab cache for magazines (without magazines) */
+    slab->magazines = _create_cache(slab, MEMORY_SLAB_MAGAZINE_NAME,
+                                    sizeof(memory_slab_magazine_t), 0, 0);
+    if ( NULL == slab->magazines ) {
+        return -1;
+    }
+
+    /* Release unused slabs on memory pressure */
+    ret = phys_mem_register_shrinker(mem->phys, _shrink, slab);
+    if ( ret < 0 ) {
+        return -1;
+    }
+
     /* Unlock */
     slab->lock = 0;
 
     return 0;
 }
 
-
 /*
  * Local variables:
  * tab-width: 4
@@ -24,10 +24,12 @@
 #include <sys/syscall.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include "kernel.h"
 #include "proc.h"
 #include "vfs.h"
 #include "timer.h"
+#include "sched.h"
 #include "kvar.h"
 
 /*
@@ -47,10 +49,8 @@ sys_exit(int status)
     t->state = TASK_TERMINATED;
     t->proc->exit_status = status;
 
-    /* Infinite loop until this task has been removed */
-    for ( ;; ) {
-        hlt();
-    }
+    /* Switch to another task; this task is never resumed */
+    task_exit();
 }
 
 /*
@@ -103,6 +103,14 @@ sys_fork_c(void **task, pid_t *ret0, pid_t *ret1)
     /* Set the current process to the parent of the new process */
     proc->parent = t->proc;
 
+    /* Start the child on the processor of the parent.  N.B., the child is
+       woken up by the architecture-specific code once its stackframe is
+       prepared. */
+    proc->task->cpu = t->cpu;
+
+    /* Inherit the nice value */
+    proc->task->nice = t->nice;
+
     /* Set the process to the process table */
     g_kvar->procs[pid - 1] = proc;
 
@@ -329,6 +337,15 @@ sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
     return (void *)-1;
 }
 
+/*
+ * Wake up the task sleeping in sys_nanosleep()
+ */
+static void
+_nanosleep_wakeup(void *arg)
+{
+    sched_wakeup((task_t *)arg);
+}
+
 /*
  * Suspend thread execution for an interval measured in nanoseconds
  *
@@ -348,6 +365,9 @@ sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
  *      If sys_nanosleep() returns because the requested time has elapsed, the
  *      value returned will be zero.
  *
+ *      If the interval specified in rqtp is invalid (a negative value or
+ *      tv_nsec not less than 1000000000), the value returned will be -1.
+ *
  *      If sys_nanosleep() returns due to the delivery of a signal, the value
  *      returned will be the -1, and the global variable errno will be set to
  *      indicate the interruption.  If rmtp is non-NULL, the timespec structure
@@ -358,10 +378,9 @@ int
 sys_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
 {
     task_t *t;
-    uint64_t fire;
+    uint64_t expires;
+    uint64_t now;
     uint64_t delta;
-    timer_event_t *e;
-    timer_event_t **ep;
 
     /* Get the currently running task */
     t = this_task();
@@ -369,49 +388,43 @@ sys_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
         return -1;
     }
 
-    /* Calculate the time to fire */
-    fire = rqtp->tv_sec * HZ + (rqtp->tv_nsec * HZ / 1000000000)
-        + g_kvar->jiffies;
-
-    /* Allocate an event */
-    e = kmem_slab_alloc("timer_event");
-    if ( NULL == e ) {
+    /* Check the requested interval */
+    if ( rqtp->tv_sec < 0 || rqtp->tv_nsec < 0
+         || rqtp->tv_nsec >= 1000000000L ) {
         return -1;
     }
-    e->jiffies = fire;
-    e->proc = t->proc;
-    e->next = NULL;
 
-    /* Search the appropriate position to inesrt the timer event */
-    ep = &g_kvar->timer;
-    while ( NULL != *ep && fire < (*ep)->jiffies ) {
-        ep = &(*ep)->next;
+    /* Calculate the time to fire on the monotonic clock (TSC) of this
+       processor; the wakeup is checked against the same clock, so it never
+       fires before the deadline even if the timer interrupt comes early.
+       The deadline is saturated not to wrap around into the past. */
+    now = clock_monotonic();
+    if ( (uint64_t)rqtp->tv_sec >= (~0ULL - now) / 1000000000ULL ) {
+        expires = ~0ULL;
+    } else {
+        expires = now + rqtp->tv_sec * 1000000000ULL + rqtp->tv_nsec;
     }
-    /* Insert the event */
-    e->next = *ep;
-    *ep = e;
 
     /* Set the task state to blocked */
     t->state = TASK_BLOCKED;
     t->signaled = 0;
 
+    /* Add the timer to this processor; it does not fire before the task is
+       switched as interrupts are disabled */
+    t->timer.func = _nanosleep_wakeup;
+    hrtimer_add(t->cpu, &t->timer, expires);
+
     /* Switch the task */
     task_switch();
 
     /* Will be resumed from here when awake */
     if ( t->signaled ) {
-        /* Wake up by another signal */
+        /* Woken up by task_signal() before the timer fires */
         if ( NULL != rmtp ) {
-            if ( fire < g_kvar->jiffies ) {
-                /* No remaining time */
-                rmtp->tv_sec = 0;
-                rmtp->tv_nsec = 0;
-            } else {
-                /* Remaining time */
-                delta = fire - g_kvar->jiffies;
-                rmtp->tv_sec = delta / HZ;
-                rmtp->tv_nsec = (delta % HZ) * 1000000000 / HZ;
-            }
+            now = clock_monotonic();
+            delta = expires > now ? expires - now : 0;
+            rmtp->tv_sec = delta / 1000000000ULL;
+            rmtp->tv_nsec = delta % 1000000000ULL;
         }
         t->signaled = 0;
         return -1;
@@ -420,6 +433,97 @@ sys_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
     return 0;
 }
 
+/*
+ * Resolve the task specified by which and who of the priority system calls
+ */
+static task_t *
+_prio_task(int which, id_t who)
+{
+    proc_t *proc;
+
+    if ( PRIO_PROCESS != which ) {
+        /* Not supported */
+        return NULL;
+    }
+    if ( 0 == who ) {
+        /* Calling process */
+        return this_task();
+    }
+    if ( who < 1 || who > PROC_NR ) {
+        return NULL;
+    }
+    proc = g_kvar->procs[who - 1];
+    if ( NULL == proc ) {
+        return NULL;
+    }
+
+    return proc->task;
+}
+
+/*
+ * Get program scheduling priority
+ *
+ * SYNOPSIS
+ *      The getpriority() function obtains the scheduling priority of the
+ *      process specified by which and who.  Only PRIO_PROCESS is supported for
+ *      which, and who of 0 denotes the calling process.
+ *
+ * RETURN VALUES
+ *      The getpriority() function returns the nice value of the process in the
+ *      range of -20 to 19.  Otherwise, a value of -1 is returned.
+ */
+int
+sys_getpriority(int which, id_t who)
+{
+    task_t *t;
+
+    t = _prio_task(which, who);
+    if ( NULL == t ) {
+        return -1;
+    }
+
+    return sched_get_nice(t);
+}
+
+/*
+ * Set program scheduling priority
+ *
+ * SYNOPSIS
+ *      The setpriority() function sets the scheduling priority of the process
+ *      specified by which and who to prio.  A lower value of prio gives the
+ *      process a larger share of the processor and a shorter latency on
+ *      wakeup.  Values out of the range of -20 to 19 are clamped.  Only the
+ *      super-user may set a negative value or the priority of a process owned
+ *      by another user.
+ *
+ * RETURN VALUES
+ *      The setpriority() function returns the value 0 if successful;
+ *      otherwise, the value -1 is returned.
+ */
+int
+sys_setpriority(int which, id_t who, int prio)
+{
+    task_t *cur;
+    task_t *t;
+
+    cur = this_task();
+    if ( NULL == cur || NULL == cur->proc ) {
+        return -1;
+    }
+    t = _prio_task(which, who);
+    if ( NULL == t || NULL == t->proc ) {
+        return -1;
+    }
+    if ( 0 != cur->proc->uid
+         && (prio < 0 || t->proc->uid != cur->proc->uid) ) {
+        /* Not permitted */
+        return -1;
+    }
+    sched_set_nice(t, prio);
+
+    return 0;
+}
+
 /*
  * Mount a filesystem
  *
@@ -525,8 +629,12 @@ sys_initexec(const char *path, char *const argv[], char *const envp[])
     /* Update the process name */
     kstrlcpy(t->proc->name, path, PATH_MAX);
 
-    /* Copy the program */
-    kmemcpy((void *)PROC_PROG_ADDR, start, size);
+    /* Copy the program (through the kernel mapping since the text is
+       read-only and may be shared copy-on-write with the parent) */
+    ret = virt_memory_write(t->proc->vmem, PROC_PROG_ADDR, start, size);
+    if ( ret < 0 ) {
+        return -1;
+    }
 
     /* Execute the task */
     task_exec(t);
@@ -535,6 +643,47 @@ sys_initexec(const char *path, char *const argv[], char *const envp[])
     return 0;
 }
 
+/*
+ * Set the memory policy of the current process
+ *
+ * SYNOPSIS
+ *      The set_mempolicy() function sets the policy to choose the NUMA domain
+ *      of the pages allocated for the current process: MPOL_LOCAL allocates
+ *      from the domain of the running processor first and falls back to the
+ *      nearest ones, MPOL_BIND allocates only from the domain specified by
+ *      domain, and MPOL_INTERLEAVE spreads the pages over all domains.  The
+ *      policy is inherited by forked processes.
+ *
+ * RETURN VALUES
+ *      The set_mempolicy() function returns the value 0 if successful;
+ *      otherwise, the value -1 is returned.
+ */
+int
+sys_set_mempolicy(int mode, int domain)
+{
+    task_t *t;
+    memory_policy_t *policy;
+
+    t = this_task();
+    if ( NULL == t || NULL == t->proc ) {
+        return -1;
+    }
+    if ( mode < 0 || mode > MEMORY_POLICY_MAX ) {
+        return -1;
+    }
+    if ( MEMORY_POLICY_BIND == mode
+         && (domain < 0 || domain > g_kvar->phys.max_domain) ) {
+        return -1;
+    }
+
+    policy = &t->proc->vmem->policy;
+    policy->mode = mode;
+    policy->domain = MEMORY_POLICY_BIND == mode ? domain : 0;
+    policy->next = 0;
+
+    return 0;
+}
+
 /*
  * Local variables:
  * tab-width: 4
@@ -23,6 +23,7 @@
 
 #include "kernel.h"
 #include "proc.h"
+#include "sched.h"
 #include "kvar.h"
 
 /*
@@ -31,43 +32,51 @@
 int
 task_mgr_init(size_t atsize)
 {
-    int ret;
+    task_mgr_t *mgr;
     int i;
     int nr;
 
+    mgr = &g_kvar->task_mgr;
+
     /* Allocate the process slab */
-    ret = kmem_slab_create_cache(SLAB_PROC, sizeof(proc_t));
-    if ( ret < 0 ) {
+    mgr->proc_cache = kmem_slab_create_cache(SLAB_PROC, sizeof(proc_t), 0);
+    if ( NULL == mgr->proc_cache ) {
         return -1;
     }
 
     /* Allocate the file descriptor slab */
-    ret = kmem_slab_create_cache(SLAB_FILDES, sizeof(fildes_t));
-    if ( ret < 0 ) {
+    mgr->fildes_cache = kmem_slab_create_cache(SLAB_FILDES, sizeof(fildes_t),
+                                               0);
+    if ( NULL == mgr->fildes_cache ) {
         return -1;
     }
 
     /* Allocate the kernel stack slab */
-    ret = kmem_slab_create_cache(SLAB_TASK_STACK, KSTACK_SIZE);
-    if ( ret < 0 ) {
+    mgr->kstack_cache = kmem_slab_create_cache(SLAB_TASK_STACK, KSTACK_SIZE, 0);
+    if ( NULL == mgr->kstack_cache ) {
         return -1;
     }
 
-    /* Allocate the task */
-    ret = kmem_slab_create_cache(SLAB_TASK, sizeof(task_t) + atsize);
-    if ( ret < 0 ) {
+    /* Allocate the task (aligned to cache lines so that the fields at the
+       head of task_t are on a single line) */
+    mgr->task_cache = kmem_slab_create_cache(SLAB_TASK,
+                                             sizeof(task_t) + atsize,
+                                             MEMORY_SLAB_CACHE_LINE_ALIGN);
+    if ( NULL == mgr->task_cache ) {
         return -1;
     }
 
     /* Allocate the task list */
-    ret = kmem_slab_create_cache(SLAB_TASK_LIST, sizeof(task_list_t));
-    if ( ret < 0 ) {
+    mgr->task_list_cache = kmem_slab_create_cache(SLAB_TASK_LIST,
+                                                  sizeof(task_list_t), 0);
+    if ( NULL == mgr->task_list_cache ) {
         return -1;
     }
 
     /* Initialize the process table */
     nr = (sizeof(proc_t *) * PROC_NR + MEMORY_PAGESIZE - 1) / MEMORY_PAGESIZE;
-    g_kvar->procs = memory_alloc_pages(&g_kvar->mm, nr, MEMORY_ZONE_KERNEL, 0);
+    g_kvar->procs = memory_alloc_pages(&g_kvar->mm, nr, MEMORY_ZONE_KERNEL, 0,
+                                       0);
     if ( NULL == g_kvar->procs ) {
         return -1;
     }
@@ -76,7 +85,7 @@ task_mgr_init(size_t atsize)
     }
 
     /* Initialize the task manager */
-    g_kvar->task_mgr.lock = 0;
+    mgr->lock = 0;
 
     return 0;
 }
@@ -90,29 +99,51 @@ task_alloc(void)
     task_t *t;
 
     /* Prepare a task data structure */
-    t = kmem_slab_alloc(SLAB_TASK);
+    t = kmem_slab_cache_alloc(g_kvar->task_mgr.task_cache);
     if ( NULL == t ) {
         return NULL;
     }
     t->arch = (void *)t + sizeof(task_t);
 
     /* Prepare kernel stack */
-    t->kstack = kmem_slab_alloc(SLAB_TASK_STACK);
+    t->kstack = kmem_slab_cache_alloc(g_kvar->task_mgr.kstack_cache);
     if ( NULL == t->kstack ) {
-        kmem_slab_free(SLAB_TASK, t);
+        kmem_slab_cache_free(g_kvar->task_mgr.task_cache, t);
         return NULL;
     }
 
     /* Set the initial values */
     t->proc = NULL;
     t->id = 0;
-    t->state = TASK_READY;
+    t->state = TASK_CREATED;
     t->next = NULL;
+    t->rqnode.data = t;
+    t->cpu = 0;
+    t->queued = 0;
+    t->oncpu = 0;
     t->credit = 0;
+    t->nice = 0;
+    t->vruntime = 0;
+    t->signaled = 0;
+    hrtimer_init(&t->timer, NULL, t);
 
     return t;
 }
 
+/*
+ * Signal a task; this cancels its sleep and wakes it up if blocked in
+ * sys_nanosleep()
+ */
+void
+task_signal(task_t *t)
+{
+    /* Interrupt the sleep only if the timer has not fired yet */
+    if ( hrtimer_cancel(&t->timer) ) {
+        t->signaled = 1;
+        sched_wakeup(t);
+    }
+}
+
 /*
  * Local variables:
  * tab-width: 4
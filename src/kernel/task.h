@@ -25,6 +25,9 @@
 #define _ADVOS_FILDES_H
 
 #include "kernel.h"
+#include "timer.h"
+#include "memory.h"
+#include "tree.h"
 
 typedef struct _task task_t;
 
@@ -57,14 +60,35 @@ struct _task {
     /* State */
     task_state_t state;
 
-    /* Next scheduled task (runqueue) */
+    /* Next task in the list of tasks migrated between run queues */
     task_t *next;
 
+    /* Node of the run queue sorted by the virtual runtime */
+    btree_node_t rqnode;
+
+    /* Processor of the run queue this task belongs to */
+    int cpu;
+
+    /* Linked to the run queue? */
+    volatile int queued;
+
+    /* Set while the context of this task is loaded on a processor */
+    volatile int oncpu;
+
     /* Quantum */
     int credit;
 
+    /* Nice value */
+    int nice;
+
+    /* Virtual runtime weighted by the nice value */
+    uint64_t vruntime;
+
     /* Signaled? */
     int signaled;
+
+    /* Timer to wake up from sleep */
+    hrtimer_t timer;
 };
 
 /*
@@ -81,17 +105,26 @@ struct _task_list {
  */
 typedef struct {
     int lock;
+    /* Slab caches */
+    memory_slab_cache_t *proc_cache;
+    memory_slab_cache_t *fildes_cache;
+    memory_slab_cache_t *kstack_cache;
+    memory_slab_cache_t *task_cache;
+    memory_slab_cache_t *task_list_cache;
 } task_mgr_t;
 
 /* Defined in task.c */
 int task_mgr_init(size_t);
 task_t * task_alloc(void);
+void task_signal(task_t *);
 
-/* Defined in arch/<>architecture/{task.c,asm.S} */
+/* Defined in arch/<>architecture/{arch.c,task.c,asm.S} */
 task_t * this_task(void);
 int task_init(task_t *, void *);
 void task_exec(task_t *);
 void task_switch(void);
+void task_resched(int);
+void task_exit(void);
 
 #endif
 
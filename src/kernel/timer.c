@@ -0,0 +1,241 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "kernel.h"
+#include "timer.h"
+#include "proc.h"
+#include "kvar.h"
+
+/*
+ * Initialize the timer manager for nr processors
+ */
+int
+timer_init(int nr)
+{
+    int i;
+    int npg;
+
+    npg = (sizeof(timer_cpu_t *) * nr + MEMORY_PAGESIZE - 1)
+        / MEMORY_PAGESIZE;
+    g_kvar->timer.cpus = memory_alloc_pages(&g_kvar->mm, npg,
+                                            MEMORY_ZONE_KERNEL, 0, 0);
+    if ( NULL == g_kvar->timer.cpus ) {
+        return -1;
+    }
+    for ( i = 0; i < nr; i++ ) {
+        g_kvar->timer.cpus[i] = NULL;
+    }
+    g_kvar->timer.nr = nr;
+
+    return 0;
+}
+
+/*
+ * Prepare the timers of the specified processor
+ */
+int
+timer_cpu_init(int cpu)
+{
+    timer_cpu_t *c;
+    int npg;
+
+    npg = (sizeof(timer_cpu_t) + MEMORY_PAGESIZE - 1) / MEMORY_PAGESIZE;
+    c = memory_alloc_pages(&g_kvar->mm, npg, MEMORY_ZONE_KERNEL, 0,
+                           MEMORY_ALLOC_ZEROED);
+    if ( NULL == c ) {
+        return -1;
+    }
+    g_kvar->timer.cpus[cpu] = c;
+
+    return 0;
+}
+
+/*
+ * Compare the expiries of two high-resolution timers
+ */
+static int
+_comp(void *a, void *b)
+{
+    hrtimer_t *x;
+    hrtimer_t *y;
+
+    x = a;
+    y = b;
+    if ( x->expires == y->expires ) {
+        return 0;
+    }
+
+    return x->expires > y->expires ? 1 : -1;
+}
+
+/*
+ * Get the earliest timer in the tree
+ */
+static hrtimer_t *
+_first(btree_node_t *n)
+{
+    if ( NULL == n ) {
+        return NULL;
+    }
+    while ( NULL != n->left ) {
+        n = n->left;
+    }
+
+    return n->data;
+}
+
+/*
+ * Initialize a high-resolution timer
+ */
+void
+hrtimer_init(hrtimer_t *h, void (*func)(void *), void *arg)
+{
+    h->expires = 0;
+    h->func = func;
+    h->arg = arg;
+    h->cpu = -1;
+    h->node.data = h;
+}
+
+/*
+ * Add a high-resolution timer to the specified processor to fire at the
+ * specified monotonic clock (in nanoseconds)
+ */
+void
+hrtimer_add(int cpu, hrtimer_t *h, uint64_t expires)
+{
+    timer_cpu_t *c;
+    int rearm;
+    int ret;
+
+    c = g_kvar->timer.cpus[cpu];
+    spin_lock(&c->lock);
+    h->expires = expires;
+    h->cpu = cpu;
+    ret = btree_add(&c->hrtimers, &h->node, _comp, 1);
+    kassert(ret == 0);
+    if ( NULL == c->first || expires < c->first->expires ) {
+        c->first = h;
+    }
+    /* The processor re-arms its timer when it fires otherwise */
+    rearm = 0 == c->armed || expires < c->armed;
+    if ( rearm ) {
+        c->armed = expires;
+    }
+    spin_unlock(&c->lock);
+
+    if ( rearm ) {
+        /* Let the processor re-arm its timer for the earlier expiry */
+        task_resched(cpu);
+    }
+}
+
+/*
+ * Cancel a high-resolution timer; returns 1 if it was pending
+ */
+int
+hrtimer_cancel(hrtimer_t *h)
+{
+    timer_cpu_t *c;
+    btree_node_t *n;
+    int cpu;
+    int ret;
+
+    /* N.B., h->cpu is not changed while the timer is pending */
+    cpu = h->cpu;
+    if ( cpu < 0 ) {
+        return 0;
+    }
+    c = g_kvar->timer.cpus[cpu];
+    spin_lock(&c->lock);
+    if ( h->cpu == cpu ) {
+        n = btree_delete(&c->hrtimers, &h->node, _comp);
+        kassert(n == &h->node);
+        if ( c->first == h ) {
+            c->first = _first(c->hrtimers);
+        }
+        h->cpu = -1;
+        ret = 1;
+    } else {
+        ret = 0;
+    }
+    spin_unlock(&c->lock);
+
+    return ret;
+}
+
+/*
+ * Fire the high-resolution timers of the specified processor expired by now
+ */
+void
+hrtimer_run(int cpu, uint64_t now)
+{
+    timer_cpu_t *c;
+    hrtimer_t *h;
+
+    c = g_kvar->timer.cpus[cpu];
+    spin_lock(&c->lock);
+    while ( NULL != c->first && c->first->expires <= now ) {
+        h = c->first;
+        btree_delete(&c->hrtimers, &h->node, _comp);
+        c->first = _first(c->hrtimers);
+        h->cpu = -1;
+        h->func(h->arg);
+    }
+    spin_unlock(&c->lock);
+}
+
+/*
+ * Record that the timer of the specified processor is armed at the expiry of
+ * the earliest high-resolution timer or at the limit (0 for none), whichever
+ * is earlier.  This returns the expiry if it is earlier than the limit, or 0
+ * otherwise.  Timers added later are notified only if they expire earlier.
+ */
+uint64_t
+hrtimer_arm(int cpu, uint64_t limit)
+{
+    timer_cpu_t *c;
+    uint64_t expires;
+
+    c = g_kvar->timer.cpus[cpu];
+    spin_lock(&c->lock);
+    expires = NULL != c->first ? c->first->expires : 0;
+    if ( expires > 0 && (0 == limit || expires < limit) ) {
+        c->armed = expires;
+    } else {
+        c->armed = limit;
+        expires = 0;
+    }
+    spin_unlock(&c->lock);
+
+    return expires;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
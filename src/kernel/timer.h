@@ -24,21 +24,61 @@
 #ifndef _ADVOS_TIMER_H
 #define _ADVOS_TIMER_H
 
-#include "proc.h"
+#include <stdint.h>
+#include "tree.h"
 
 /*
- * Kernel timer
+ * High-resolution timer
  */
-typedef struct _timer_event timer_event_t;
-struct _timer_event {
-    /* Jiffies to fire this event */
-    uint64_t jiffies;
-    /* Process attached to this event */
-    proc_t *proc;
-    /* Next scheduled event */
-    timer_event_t *next;
+typedef struct _hrtimer hrtimer_t;
+struct _hrtimer {
+    /* Monotonic clock (in nanoseconds) to fire this timer */
+    uint64_t expires;
+    /* Callback called on expiry (with the lock of the processor held) */
+    void (*func)(void *);
+    void *arg;
+    /* Processor of the timer (-1 if not pending) */
+    int cpu;
+    /* Node of the tree sorted by the expiry */
+    btree_node_t node;
 };
 
+/*
+ * Per-processor timers
+ */
+typedef struct {
+    /* Lock */
+    int lock;
+    /* Pending high-resolution timers (balanced tree sorted by the expiry) */
+    btree_node_t *hrtimers;
+    /* Earliest pending timer (the leftmost node) */
+    hrtimer_t *first;
+    /* Monotonic clock the timer of the processor is armed at (0 if stopped) */
+    uint64_t armed;
+} timer_cpu_t;
+
+/*
+ * Timer manager
+ */
+typedef struct {
+    /* Number of processors */
+    int nr;
+    /* Timers indexed by the processor ID */
+    timer_cpu_t **cpus;
+} timer_mgr_t;
+
+/* Defined in timer.c */
+int timer_init(int);
+int timer_cpu_init(int);
+void hrtimer_init(hrtimer_t *, void (*)(void *), void *);
+void hrtimer_add(int, hrtimer_t *, uint64_t);
+int hrtimer_cancel(hrtimer_t *);
+void hrtimer_run(int, uint64_t);
+uint64_t hrtimer_arm(int, uint64_t);
+
+/* Architecture-specific monotonic clock in nanoseconds */
+uint64_t clock_monotonic(void);
+
 #endif
 
 /*
@@ -25,67 +25,238 @@
 #include "tree.h"
 
 /*
- * Add a node to the binary tree
+ * Height of the subtree
+ */
+static __inline__ int
+_height(btree_node_t *n)
+{
+    return NULL == n ? 0 : n->height;
+}
+
+/*
+ * Update the height (and the augmented data if aug is specified) of the node
+ * from its children
+ */
+static __inline__ void
+_update(btree_node_t *n, void (*aug)(btree_node_t *))
+{
+    int hl;
+    int hr;
+
+    hl = _height(n->left);
+    hr = _height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+    if ( NULL != aug ) {
+        aug(n);
+    }
+}
+
+/*
+ * Rotate the subtree to the left
+ */
+static void
+_rotate_left(btree_node_t **t, void (*aug)(btree_node_t *))
+{
+    btree_node_t *n;
+    btree_node_t *r;
+
+    n = *t;
+    r = n->right;
+    n->right = r->left;
+    r->left = n;
+    _update(n, aug);
+    _update(r, aug);
+    *t = r;
+}
+
+/*
+ * Rotate the subtree to the right
+ */
+static void
+_rotate_right(btree_node_t **t, void (*aug)(btree_node_t *))
+{
+    btree_node_t *n;
+    btree_node_t *l;
+
+    n = *t;
+    l = n->left;
+    n->left = l->right;
+    l->right = n;
+    _update(n, aug);
+    _update(l, aug);
+    *t = l;
+}
+
+/*
+ * Restore the balance of the subtree whose children are balanced
+ */
+static void
+_rebalance(btree_node_t **t, void (*aug)(btree_node_t *))
+{
+    btree_node_t *n;
+    int bf;
+
+    n = *t;
+    bf = _height(n->left) - _height(n->right);
+    if ( bf > 1 ) {
+        if ( _height(n->left->left) < _height(n->left->right) ) {
+            _rotate_left(&n->left, aug);
+        }
+        _rotate_right(t, aug);
+    } else if ( bf < -1 ) {
+        if ( _height(n->right->right) < _height(n->right->left) ) {
+            _rotate_right(&n->right, aug);
+        }
+        _rotate_left(t, aug);
+    } else {
+        _update(n, aug);
+    }
+}
+
+/*
+ * Compare the node to a node in the tree; the nodes of the same key are
+ * ordered by their addresses so that rotations keep them reachable
+ */
+static __inline__ int
+_comp(btree_node_t *n, btree_node_t *x, int (*comp)(void *, void *))
+{
+    int ret;
+
+    ret = comp(n->data, x->data);
+    if ( 0 == ret && n != x ) {
+        ret = (uintptr_t)n > (uintptr_t)x ? 1 : -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Add a node to the binary tree; aug is called to update the augmented data
+ * of each node whose subtree changes, bottom-up
  */
 int
-btree_add(btree_node_t **t, btree_node_t *n, int (*comp)(void *, void *),
-          int allowdup)
+btree_add_augmented(btree_node_t **t, btree_node_t *n,
+                    int (*comp)(void *, void *), int allowdup,
+                    void (*aug)(btree_node_t *))
 {
+    btree_node_t **path[BTREE_MAX_HEIGHT];
+    btree_node_t **x;
+    int depth;
     int ret;
 
-    if ( NULL == *t ) {
-        /* Insert here */
-        *t = n;
-        n->left = NULL;
-        n->right = NULL;
-        return 0;
+    /* Search the position to insert */
+    depth = 0;
+    x = t;
+    while ( NULL != *x ) {
+        if ( !allowdup && 0 == comp(n->data, (*x)->data) ) {
+            return -1;
+        }
+        ret = _comp(n, *x, comp);
+        path[depth++] = x;
+        if ( ret > 0 ) {
+            x = &(*x)->right;
+        } else {
+            x = &(*x)->left;
+        }
     }
-    ret = comp(n->data, *t);
-    if ( !allowdup && 0 == ret ) {
-        return -1;
+
+    /* Insert here */
+    n->left = NULL;
+    n->right = NULL;
+    n->height = 1;
+    *x = n;
+    if ( NULL != aug ) {
+        aug(n);
     }
-    if ( ret > 0 ) {
-        return btree_add(&(*t)->right, n, comp, allowdup);
-    } else {
-        return btree_add(&(*t)->left, n, comp, allowdup);
+
+    /* Rebalance the ancestors */
+    while ( depth > 0 ) {
+        _rebalance(path[--depth], aug);
     }
+
     return 0;
 }
 
 /*
- * Remove a node from the binary tree
+ * Add a node to the binary tree
+ */
+int
+btree_add(btree_node_t **t, btree_node_t *n, int (*comp)(void *, void *),
+          int allowdup)
+{
+    return btree_add_augmented(t, n, comp, allowdup, NULL);
+}
+
+/*
+ * Remove a node from the binary tree; aug is called as btree_add_augmented()
  */
 btree_node_t *
-btree_delete(btree_node_t **t, btree_node_t *n, int (*comp)(void *, void *))
+btree_delete_augmented(btree_node_t **t, btree_node_t *n,
+                       int (*comp)(void *, void *),
+                       void (*aug)(btree_node_t *))
 {
+    btree_node_t **path[BTREE_MAX_HEIGHT];
     btree_node_t **x;
+    btree_node_t **y;
+    btree_node_t *s;
+    int depth;
+    int i;
 
-    if ( NULL == *t ) {
+    /* Search the node */
+    depth = 0;
+    x = t;
+    while ( NULL != *x && n != *x ) {
+        path[depth++] = x;
+        if ( _comp(n, *x, comp) > 0 ) {
+            x = &(*x)->right;
+        } else {
+            x = &(*x)->left;
+        }
+    }
+    if ( NULL == *x ) {
         /* Not found */
         return NULL;
     }
-    if ( n == *t ) {
-        if ( n->left && n->right ) {
-            *t = n->left;
-            x = &n->left;
-            while ( NULL != *x ) {
-                x = &(*x)->right;
-            }
-            *x = n->right;
-        } else if ( n->left ) {
-            *t = n->left;
-        } else if ( n->right ) {
-            *t = n->right;
-        } else {
-            *t = NULL;
+
+    if ( NULL == n->left ) {
+        *x = n->right;
+    } else if ( NULL == n->right ) {
+        *x = n->left;
+    } else {
+        /* Replace the node with its successor */
+        path[depth++] = x;
+        i = depth;
+        y = &n->right;
+        while ( NULL != (*y)->left ) {
+            path[depth++] = y;
+            y = &(*y)->left;
+        }
+        s = *y;
+        *y = s->right;
+        s->left = n->left;
+        s->right = n->right;
+        *x = s;
+        if ( depth > i ) {
+            /* The link from the removed node is now from the successor */
+            path[i] = &s->right;
         }
-        return n;
     }
-    if ( comp(n->data, (*t)) > 0 ) {
-        return btree_delete(&(*t)->right, n, comp);
-    } else {
-        return btree_delete(&(*t)->left, n, comp);
+
+    /* Rebalance the ancestors */
+    while ( depth > 0 ) {
+        _rebalance(path[--depth], aug);
     }
+
+    return n;
+}
+
+/*
+ * Remove a node from the binary tree
+ */
+btree_node_t *
+btree_delete(btree_node_t **t, btree_node_t *n, int (*comp)(void *, void *))
+{
+    return btree_delete_augmented(t, n, comp, NULL);
 }
 
 /*
@@ -96,18 +267,18 @@ btree_search(btree_node_t *n, void *data, int (*cond)(void *, void *))
 {
     int ret;
 
-    if ( NULL == n ) {
-        return NULL;
+    while ( NULL != n ) {
+        ret = cond(n->data, data);
+        if ( 0 == ret ) {
+            return n;
+        } else if ( ret > 0 ) {
+            n = n->right;
+        } else {
+            n = n->left;
+        }
     }
 
-    ret = cond(n->data, data);
-    if ( 0 == ret ) {
-        return n;
-    } else if ( ret > 0 ) {
-        return btree_search(n->right, data, cond);
-    } else {
-        return btree_search(n->left, data, cond);
-    }
+    return NULL;
 }
 
 /*
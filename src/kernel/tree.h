@@ -24,16 +24,31 @@
 #ifndef _ADVOS_KERNEL_TREE_H
 #define _ADVOS_KERNEL_TREE_H
 
+/* Maximum height of a tree (an AVL tree of this height has more than 2^32
+   nodes) */
+#define BTREE_MAX_HEIGHT        48
+
+/*
+ * Node of a binary search tree balanced as an AVL tree
+ */
 typedef struct btree_node btree_node_t;
 struct btree_node {
     btree_node_t *left;
     btree_node_t *right;
     void *data;
+    /* Height of the subtree rooted at this node */
+    int height;
 };
 
 int btree_add(btree_node_t **, btree_node_t *, int (*)(void *, void *), int);
 btree_node_t *
 btree_delete(btree_node_t **, btree_node_t *, int (*)(void *, void *));
+int
+btree_add_augmented(btree_node_t **, btree_node_t *, int (*)(void *, void *),
+                    int, void (*)(btree_node_t *));
+btree_node_t *
+btree_delete_augmented(btree_node_t **, btree_node_t *,
+                       int (*)(void *, void *), void (*)(btree_node_t *));
 btree_node_t * btree_search(btree_node_t *, void *, int (*)(void *, void *));
 int btree_traverse(btree_node_t *, void *, int (*)(void *, void *));
 
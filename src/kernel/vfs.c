@@ -28,6 +28,11 @@
 #define SLAB_VFS_MODULE     "vfs_module"
 #define SLAB_VFS_MOUNT      "vfs_mount"
 #define SLAB_VNODE          "vnode"
+
+/* Slab caches */
+static memory_slab_cache_t *_module_cache;
+static memory_slab_cache_t *_mount_cache;
+static memory_slab_cache_t *_vnode_cache;
 #define VFS_DIR_DELIMITER   '/'
 
 vfs_t vfs;
@@ -48,25 +53,27 @@ vfs_init(void)
     }
 
     /* Create a slab cache for filesystem modules */
-    ret = kmem_slab_create_cache(SLAB_VFS_MODULE, sizeof(vfs_module_t));
-    if ( ret < 0 ) {
+    _module_cache = kmem_slab_create_cache(SLAB_VFS_MODULE,
+                                           sizeof(vfs_module_t), 0);
+    if ( NULL == _module_cache ) {
         return -1;
     }
 
     /* Create a slab cache for the mount data structure */
-    ret = kmem_slab_create_cache(SLAB_VFS_MOUNT, sizeof(vfs_mount_t));
-    if ( ret < 0 ) {
+    _mount_cache = kmem_slab_create_cache(SLAB_VFS_MOUNT, sizeof(vfs_mount_t),
+                                          0);
+    if ( NULL == _mount_cache ) {
         return -1;
     }
 
     /* Create a slab cache for vnodes */
-    ret = kmem_slab_create_cache(SLAB_VNODE, sizeof(vfs_vnode_t));
-    if ( ret < 0 ) {
+    _vnode_cache = kmem_slab_create_cache(SLAB_VNODE, sizeof(vfs_vnode_t), 0);
+    if ( NULL == _vnode_cache ) {
         return -1;
     }
 
     /* Prepare the rootfs vnode */
-    vnode = kmem_slab_alloc(SLAB_VNODE);
+    vnode = kmem_slab_cache_alloc(_vnode_cache);
     if ( NULL == vnode ) {
         return -1;
     }
@@ -101,7 +108,7 @@ vfs_register(const char *type, vfs_interfaces_t *ifs, void *spec)
     }
 
     /* Allocate a vfs module */
-    e = kmem_slab_alloc(SLAB_VFS_MODULE);
+    e = kmem_slab_cache_alloc(_module_cache);
     if ( NULL == e ) {
         return -1;
     }
@@ -221,7 +228,7 @@ vfs_mount(const char *type, const char *dir, int flags, void *data)
     }
 
     /* Allocate mount data structure */
-    mount = kmem_slab_alloc(SLAB_VFS_MOUNT);
+    mount = kmem_slab_cache_alloc(_mount_cache);
     if ( NULL == mount ) {
         return -1;
     }
@@ -276,7 +283,7 @@ vfs_unmount(const char *dir, int flags)
     if ( ret < 0 ) {
         return -1;
     }
-    kmem_slab_free(SLAB_VFS_MOUNT, vnode->mount);
+    kmem_slab_cache_free(_mount_cache, vnode->mount);
     vnode->mount = NULL;
 
     return 0;
@@ -305,7 +312,7 @@ vfs_lookup(const char *dir, vfs_vnode_t *cur)
 vfs_vnode_t *
 vfs_vnode_alloc(void)
 {
-    return kmem_slab_alloc(SLAB_VNODE);
+    return kmem_slab_cache_alloc(_vnode_cache);
 }
 
 /*
@@ -37,6 +37,15 @@ initexec(const char *path, char *const argv[], char *const envp[])
     return syscall(SYS_initexec, path, argv, envp);
 }
 
+/*
+ * Set the memory policy of this process
+ */
+int
+set_mempolicy(int mode, int domain)
+{
+    return syscall(SYS_set_mempolicy, mode, domain);
+}
+
 /*
  * MMIO
  */
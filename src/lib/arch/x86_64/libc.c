@@ -22,10 +22,13 @@
  */
 
 #include <sys/syscall.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <time.h>
+#include <advos/timepage.h>
 
 unsigned long long syscall(int, ...);
+unsigned long long rdtsc(void);
 
 /*
  * exit
@@ -66,6 +69,53 @@ nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
     return syscall(SYS_nanosleep, rqtp, rmtp);
 }
 
+/*
+ * clock_gettime; read the time page exported by the kernel without a system
+ * call
+ */
+int
+clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+    volatile struct timepage *tpg;
+    uint32_t seq;
+    uint64_t ns;
+
+    if ( CLOCK_MONOTONIC != clock_id ) {
+        return -1;
+    }
+
+    tpg = (volatile struct timepage *)TIMEPAGE_ADDR;
+    do {
+        seq = tpg->seq;
+        __asm__ __volatile__ ("" ::: "memory");
+        ns = ((__uint128_t)(rdtsc() - tpg->base) * tpg->mult) >> tpg->shift;
+        __asm__ __volatile__ ("" ::: "memory");
+    } while ( (seq & 1) || seq != tpg->seq );
+
+    tp->tv_sec = ns / 1000000000ULL;
+    tp->tv_nsec = ns % 1000000000ULL;
+
+    return 0;
+}
+
+/*
+ * getpriority
+ */
+int
+getpriority(int which, id_t who)
+{
+    return syscall(SYS_getpriority, which, who);
+}
+
+/*
+ * setpriority
+ */
+int
+setpriority(int which, id_t who, int prio)
+{
+    return syscall(SYS_setpriority, which, who, prio);
+}
+
 /*
  * Local variables:
  * tab-width: 4
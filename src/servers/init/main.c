@@ -24,11 +24,105 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sys/resource.h>
 #include <sys/advos.h>
 #include <time.h>
 
 unsigned long long syscall(int, ...);
 
+#if defined(BENCH) && BENCH
+unsigned long long rdtsc(void);
+
+/* Number of system calls in the microbenchmark */
+#define SYSCALL_BENCH_ITER      10000
+
+/* Rounds of the slab microbenchmark (32 kmalloc/kfree pairs per round) and
+   the maximum number of concurrent workers */
+#define SLAB_BENCH_ITER         10000
+#define SLAB_BENCH_BATCH        32
+#define SLAB_BENCH_MAX_WORKERS  8
+
+/* Number of mixed-size page allocations and frees in the virtual memory
+   allocator stress test */
+#define VMEM_BENCH_ITER         10000
+
+/*
+ * Measure the average cost of a system call in TSC cycles
+ */
+static unsigned long long
+syscall_bench(void)
+{
+    unsigned long long t0;
+    unsigned long long t1;
+    int i;
+
+    t0 = rdtsc();
+    for ( i = 0; i < SYSCALL_BENCH_ITER; i++ ) {
+        (void)getpriority(PRIO_PROCESS, 0);
+    }
+    t1 = rdtsc();
+
+    return (t1 - t0) / SYSCALL_BENCH_ITER;
+}
+
+/*
+ * Measure the slab allocator throughput with 1, 2, 4, and 8 concurrent
+ * workers (spread over the processors by the scheduler).  The first worker of
+ * each round prints the number of workers in the top digit and its cycles per
+ * kmalloc/kfree pair in the rest at the line of the round, while the others
+ * only contend; the cost stays flat while the throughput scales.
+ */
+static void
+slab_bench(void)
+{
+    unsigned long long t0;
+    unsigned long long t1;
+    struct timespec tm;
+    int round;
+    int n;
+    int i;
+
+    tm.tv_sec = 1;
+    tm.tv_nsec = 0;
+    round = 0;
+    for ( n = 1; n <= SLAB_BENCH_MAX_WORKERS; n <<= 1 ) {
+        for ( i = 0; i < n; i++ ) {
+            if ( 0 == fork() ) {
+                /* Worker */
+                t0 = rdtsc();
+                syscall(767, SLAB_BENCH_ITER, 64);
+                t1 = rdtsc();
+                if ( 0 == i ) {
+                    syscall(766, 17 + round, ((unsigned long long)n << 28)
+                            | ((t1 - t0)
+                               / (SLAB_BENCH_ITER * SLAB_BENCH_BATCH)));
+                }
+                exit(0);
+            }
+        }
+        /* Wait for the workers */
+        nanosleep(&tm, NULL);
+        round++;
+    }
+}
+
+/*
+ * Measure the average cost of a kernel page allocation or free in TSC cycles
+ */
+static unsigned long long
+vmem_bench(void)
+{
+    unsigned long long t0;
+    unsigned long long t1;
+
+    t0 = rdtsc();
+    syscall(765, VMEM_BENCH_ITER);
+    t1 = rdtsc();
+
+    return (t1 - t0) / VMEM_BENCH_ITER;
+}
+#endif
+
 /*
  * Entry point for the init program
  */
@@ -52,10 +146,24 @@ main(int argc, char *argv[])
         /* Parent */
         syscall(766, 22, pid);
 
+#if defined(BENCH) && BENCH
+        /* Per-syscall cycle cost */
+        syscall(766, 21, syscall_bench());
+
+        /* Slab allocator scalability */
+        slab_bench();
+
+        /* Virtual memory allocator under fragmentation */
+        syscall(766, 16, vmem_bench());
+#endif
+
         struct timespec tm;
         tm.tv_sec = 1;
         tm.tv_nsec = 0;
         nanosleep(&tm, NULL);
+
+        /* The following loop is a batch job; yield to interactive drivers */
+        setpriority(PRIO_PROCESS, 0, 10);
         for ( ;; ) {
             syscall(766, 23, cnt);
             cnt++;